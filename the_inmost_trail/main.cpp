@@ -8,299 +8,15 @@
 #include <unordered_map>
 #include "string32.hpp"
 #include "script.hpp"
+#include "world.hpp"
+#include "net_server.hpp"
+#include "net_client.hpp"
 
 using namespace arctic;  // NOLINT
 
-const char *kNetworkServerAddress = "176.126.85.38";
-constexpr uint16_t kNetworkPort = 27000;
-
-constexpr Ui32 kAvatarCount = 100'000;
-
-constexpr Ui32 kUiiIdxBits = 20;
-constexpr Ui32 kUiiUidBits = 32 - kUiiIdxBits;
-
-constexpr Ui32 kUiiIdxMask = (Ui32(1) << kUiiIdxBits) - 1;
-constexpr Ui32 kUiiUidMask = ((Ui32(1) << kUiiUidBits) - 1);
-
-constexpr Ui32 kUiiUidStep = (Ui32(1) << kUiiIdxBits);
-
-struct Uii {
-  Ui32 value;
-  Ui32 GetIdx() const {
-    return (value & ((Ui32(1) << kUiiIdxBits) - 1));
-  }
-  Ui32 GetUid() const {
-    return (value >> kUiiIdxBits);
-  }
-  void Set(Ui32 idx, Ui32 uid) {
-    value = ((idx & kUiiIdxMask) | ((uid & kUiiUidMask) << kUiiIdxBits));
-  }
-  void NextUid() {
-    value += kUiiUidStep;
-  }
-  Uii(Ui32 idx, Ui32 uid) {
-    Set(idx, uid);
-  }
-  Uii()
-    : value(Ui32(-1)) {
-  }
-  bool operator==(const Uii& right) const {
-    return value == right.value;
-  }
-  bool operator!=(const Uii& right) const {
-    return value != right.value;
-  }
-};
-
-const Uii kInvalidUii = Uii(kUiiIdxMask, kUiiUidMask);
-
-class MapCell {
-  Ui32 items_ : kUiiIdxBits;
-  Ui32 type_ : 32 - kUiiIdxBits;
- public:
-  MapCell()
-    : items_(kUiiIdxMask)
-    , type_(0) {
-  }
-  void SetItems(Ui32 items) {
-    items_ = items;
-  }
-  Ui32 GetItems() {
-    return items_;
-  }
-};
-static_assert(sizeof(MapCell) == 4, "sizeof(MapCell) must be 4, error!");
-
-template <class T>
-class UniqueItemVector;
-
-class UniqueItemBase;
-
-class UniqueItemBase {
- protected:
-  UniqueItemBase *next_ = nullptr; // Either next free or next on map
-  UniqueItemBase *prev_ = nullptr; // Either next free or next on map
-  MapCell *cell_ = nullptr;
- public:
-  Uii uii;
-  template <class T> friend class UniqueItemVector;
-  void AddToListBefore(UniqueItemBase *p) {
-    Check(p->prev_ == nullptr, "UniqueItemBase can't AddToList item that is already in a list!");
-    Check(p->next_ == nullptr, "UniqueItemBase can't AddToList item that is already in a list!");
-    p->prev_ = this->prev_;
-    p->next_ = this;
-    if (p->prev_) {
-      p->prev_->next_ = p;
-    }
-    this->prev_ = p;
-  }
-  void SetCell(MapCell *cell) {
-    cell_ = cell;
-  }
-  MapCell* GetCell() {
-    return cell_;
-  }
-
-  template <class T> friend class UniqueItemVector;
-
-  template <class T>
-  void AddToCell(MapCell *cell, UniqueItemVector<T> &v) {
-    cell_ = cell;
-    if (cell_->GetItems() != kInvalidUii.GetIdx()) {
-      UniqueItemBase* list = &v[cell->GetItems()];
-      list->AddToListBefore(this);
-    }
-    cell->SetItems(uii.GetIdx());
-  }
-
-  UniqueItemBase* RemoveFromListGetNext() {
-    UniqueItemBase *next = next_;
-    if (next_) {
-      next_->prev_ = prev_;
-      next_ = nullptr;
-    }
-    if (prev_) {
-      prev_->next_ = next;
-      prev_ = nullptr;
-    } else {
-      if (cell_) {
-        Uii uii = kInvalidUii;
-        if (next) {
-          uii = next->uii;
-        }
-        cell_->SetItems(uii.GetIdx());
-      }
-    }
-    return next;
-  }
-
-};
-
-template <class T>
-class UniqueItemVector {
- protected:
-  static_assert(std::is_base_of<UniqueItemBase, T>::value, "T must derive from UniqueItemBase");
-  std::vector<T> items_;
-  Ui64 size_ = 0;
-  UniqueItemBase *free_ = nullptr;
-  Ui64 next_uid_ = 1;
- public:
-  void Prepare(Ui64 capacity) {
-    Check(items_.size() == 0, "UniqueItemVector must be prepared only once!");
-    items_.resize(capacity);
-  }
-
-  T& operator[](Ui64 idx) {
-    Check(idx < size_, "UniqueItemVector can't access item with idx out of bounds.");
-    return items_[idx];
-  }
-
-  T* TryGetItem(Uii uii) {
-    if (items_.size() < uii.GetIdx()) {
-      if (items_[uii.GetIdx()].uii == uii) {
-        return &items_[uii.GetIdx()];
-      }
-    }
-    return nullptr;
-  }
-
-  Ui64 Size() {
-    return size_;
-  }
-
-  void FreeItem(Uii uii) {
-    Check(uii.GetIdx() < size_, "UniqueItemVector can't free item with idx out of bounds.");
-    Check(items_[uii.GetIdx()].uii == uii, "UniqueItemVector can't free item, uii mismatch.");
-    Check(items_[uii.GetIdx()].next_ == nullptr, "UniqueItemVector can't free item, item is still on map or double free attempted, next_ != 0.");
-    Check(items_[uii.GetIdx()].prev_ == nullptr, "UniqueItemVector can't free item, item is still on map or double free attempted. prev_ != 0.");
-    items_[uii.GetIdx()].next_ = free_;
-    if (free_) {
-      free_->prev_ = &items_[uii.GetIdx()];
-    }
-    free_ = &items_[uii.GetIdx()];
-    free_->uii.NextUid();
-  }
-
-  Uii AddItem() {
-    Uii uii = kInvalidUii;
-    if (free_) {
-      Check(free_->uii.GetIdx() < size_, "UniqueItemVector can't add item, idx corruption detected (oob).");
-      Check(&items_[free_->uii.GetIdx()] == free_, "UniqueItemVector can't add item, idx corruption detected (wrong).");
-      free_->uii.NextUid();
-      uii = free_->uii;
-      free_ = std::exchange(free_->next_, nullptr);
-      if (free_) {
-        free_->prev_ = nullptr;
-      }
-    } else if (size_ + 1 < items_.size()) {
-      items_[size_]->next_ = nullptr;
-      items_[size_]->prev_ = nullptr;
-      items_[size_]->uii.Set(size_, 0);
-      uii = items_[size_]->uii;
-      ++size_;
-    }
-    return uii;
-  }
-};
-
-class UiiQueue {
-  std::vector<Uii> queue_;
-  std::vector<Ui64> queue_position_;
-  size_t front_idx_ = 0;
-  size_t back_idx_ = 0;
-  size_t length_ = 0;
-  size_t capacity_ = 0;
- public:
-
-  void Prepare(Ui64 capacity) {
-    Check(queue_.size() == 0, "UiiQueue must be prepared only once!");
-    queue_.resize(capacity);
-    queue_position_.resize(capacity);
-    for (size_t i = 0; i < capacity; ++i) {
-      queue_position_[i] = capacity;
-    }
-    capacity_ = capacity;
-  }
-
-  void PushBack(Uii uii) {
-    Check(uii.GetIdx() < capacity_, "UiiQueue cant PushBack item with idx out of bounds!");
-    if (queue_position_[uii.GetIdx()] == capacity_) {
-      Check(length_ < capacity_, "UiiQueue cant PushBack item, capacity reached!");
-      queue_position_[uii.GetIdx()] = back_idx_;
-      queue_[back_idx_] = uii;
-      ++back_idx_;
-      if (back_idx_ >= capacity_) {
-        back_idx_ = 0;
-      }
-      ++length_;
-      return;
-    }
-    Ui64 pos = queue_position_[uii.GetIdx()];
-    Check(pos < capacity_, "UiiQueue can't PushBack, queue_position_ is out of bounds");
-    if (queue_[pos].GetUid() != uii.GetUid()) {
-      queue_[pos] = uii;
-    }
-  }
-
-  size_t Length() {
-    return length_;
-  }
-
-  Uii PreviewFront() {
-    Check(length_, "UiiQueue cant PreviewFront, it is empty!");
-    return queue_[front_idx_];
-  }
-
-  Uii PopFront() {
-    Check(length_, "UiiQueue cant PopFront, it is empty!");
-    Uii uii = queue_[front_idx_];
-    ++front_idx_;
-    if (front_idx_ >= capacity_) {
-      front_idx_ = 0;
-    }
-    --length_;
-    queue_position_[uii.GetIdx()] = capacity_;
-    return uii;
-  }
-};
-
-class Map {
-  Ui32 width_;
-  Ui32 height_;
-  std::vector<MapCell> cells_;
- public:
-
-  Map(Ui32 width, Ui32 height)
-    : width_(width)
-    , height_(height)
-    , cells_(width_*height_) {
-  }
-
-  MapCell& At(Ui32 x, Ui32 y) {
-    return cells_[x*width_ + y];
-  }
-
-  const MapCell& At(Ui32 x, Ui32 y) const {
-    return cells_[x*width_ + y];
-  }
-};
-
 struct Character;
 struct Arrow;
 
-
-
-enum ChState {
-  kChStateIdle = 0,
-  kChStateWalkToPoint,
-  kChStateWalkToItem,
-  kChStateWalkToAttack,
-  kChStatePlayAttack,
-  kChStatePlayDying,
-  kChStateDead,
-  kChStateCount
-};
-
 enum ChDir {
   kChDirRight = 0,
   kChDirLeft,
@@ -318,19 +34,6 @@ struct NetFrameHeader {
   Ui32 ch_frame_count;
 };
 
-enum PlayerCmd {
-  kPlayerCmdWalkToPoint = 0,
-  kPlayerCmdInteractWithItem,
-  kPlayerCmdAttack
-};
-
-struct NetPlayerCmd {
-  Uii my_uii;
-  PlayerCmd cmd;
-  Vec2Si32 pos;
-  Uii uii;
-};
-
 enum CharacterAnimation {
   kCharacterAnimationWalk = 0,
   kCharacterAnimationAttack,
@@ -351,492 +54,6 @@ std::vector<std::string> g_character_direction_name {
   "l"
 };
 
-class Avatar : public UniqueItemBase {
- public:
-  Ui32 connection_idx = std::numeric_limits<Ui32>::max();
-  Ui8 unit_type;
-  ChState state;
-  Vec2Si32 begin_pos;
-  Vec2Si32 end_pos;
-  Ui32 begin_tick;
-  Ui32 end_tick;
-  Uii target_uii;
-};
-
-enum ConnState {
-  kConnStateInvalid = 0,
-  kConnStateJustConnected,
-  kConnStateRegistered
-};
-
-constexpr Si32 kConnBufferSize = 516;
-
-enum MsgType {
-  kMsgTypeRegistrationRequest = 0,
-  kMsgTypeRegistrationResponse = 1,
-  kMsgTypePing = 2,
-  kMsgTypePong = 3,
-  kMsgTypePlayerCmdWalkToPoint = 4,
-  kMsgTypePlayerCmdInteractWithItem = 5,
-  kMsgTypePlayerCmdAttack = 6,
-  kMsgTypeAvatarState = 7,
-  kMsgTypeCount
-};
-
-#pragma pack(push,1)
-struct MsgHeader {
-  Ui8 msg_size;
-  Ui8 msg_type;
-};
-struct MsgRegistrationRequest {
-  Ui32 protocol_version;
-};
-struct MsgRegistrationResponse {
-  enum Result {
-    kResultSuccess = 0,
-    kResultUnknownError = 1,
-    kResultProtocolVersionMismatch = 2
-  };
-  Ui32 protocol_version;
-  Ui32 result;
-  Ui32 avatar_uii;
-};
-struct MsgPing {
-  double c_time;
-};
-struct MsgPong {
-  double c_time;
-  double s_time;
-};
-struct MsgPlayerCmdWalkToPoint {
-  Ui32 avatar_uii;
-  Ui32 x;
-  Ui32 y;
-};
-struct MsgPlayerCmdInteractWithItem {
-  Ui32 avatar_uii;
-  Ui32 item_uii;
-};
-struct MsgPlayerCmdAttack {
-  Ui32 avatar_uii;
-  Ui32 target_uii;
-};
-struct MsgAvatarState {
-  Uii uii;
-  Ui8 unit_type;
-  Ui8 state;
-  Ui32 begin_tick;
-  Ui32 begin_x;
-  Ui32 begin_y;
-  Ui16 duration_ticks;
-  Si16 end_offset_x;
-  Si16 end_offset_y;
-  Uii target_uii;
-};
-#pragma pack(pop)
-
-Ui8 g_msg_size[kMsgTypeCount] = {
-  sizeof(MsgRegistrationRequest),
-  sizeof(MsgRegistrationResponse),
-  sizeof(MsgPing),
-  sizeof(MsgPong),
-  sizeof(MsgPlayerCmdWalkToPoint),
-  sizeof(MsgPlayerCmdInteractWithItem),
-  sizeof(MsgPlayerCmdAttack),
-  sizeof(MsgAvatarState)
-};
-
-class NetServerState;
-
-class Connection {
-  ConnectionSocket socket;
-  ConnState state = kConnStateInvalid;
-  Si32 buffer_used = 0;
-  char buffer[kConnBufferSize];
-  UiiQueue queue;
-  Uii uii;
-  Ui32 idx = 0;
-  char outgoing[kConnBufferSize];
-  Si32 outgoing_used = 0;
-  Si32 outgoing_sent = 0;
-
- public:
-  Uii GetUii() {
-    return uii;
-  }
-  void SetIdx(Ui32 in_idx) {
-    idx = in_idx;
-  }
-
-  void Init(ConnectionSocket &&in_socket, Ui32 in_idx) {
-    socket = std::move(in_socket);
-    state = kConnStateJustConnected;
-    queue.Prepare(kAvatarCount);
-    idx = in_idx;
-  }
-
-  void HandleMsgRegistrationRequest() {
-    MsgRegistrationRequest m;
-    memcpy(&m, buffer + sizeof(MsgHeader), sizeof(m));
-  }
-  void HandleMsgPing() {
-    MsgPing m;
-    memcpy(&m, buffer + sizeof(MsgHeader), sizeof(m));
-  }
-  void HandleMsgPlayerCmdWalkToPoint() {
-    MsgPlayerCmdWalkToPoint m;
-    memcpy(&m, buffer + sizeof(MsgHeader), sizeof(m));
-  }
-  void HandleMsgPlayerCmdInteractWithItem() {
-    MsgPlayerCmdInteractWithItem m;
-    memcpy(&m, buffer + sizeof(MsgHeader), sizeof(m));
-  }
-  void HandleMsgPlayerCmdAttack() {
-    MsgPlayerCmdAttack m;
-    memcpy(&m, buffer + sizeof(MsgHeader), sizeof(m));
-  }
-
-  void PrepareOutgoingData(NetServerState *server);
-  void Update(NetServerState *server);
-
-  bool IsValid() {
-    return socket.IsValid();
-  }
-};
-
-class NetServerState {
- public:
-  UniqueItemVector<Avatar> avatars;
-  Map map;
-  std::deque<Connection> connections;
-  ListenerSocket listener_socket;
-
-  void UpdateServer() {
-    if (!listener_socket.IsValid()) {
-      *Log() << Time() << " UpdateServer listener_socket is invalid, starting a new one";
-      listener_socket = ListenerSocket(AddressFamily::kIpV4, SocketProtocol::kTcp);
-      if (!listener_socket.IsValid()) {
-        *Log() << "UpdateServer ListenerSocket: " << listener_socket.GetLastError();
-        return;
-      }
-      SocketResult res = listener_socket.SetSoLinger(false, 0);
-      if (res != kSocketOk) {
-        *Log() << "UpdateServer SetSoLinger: " << listener_socket.GetLastError();
-        listener_socket = ListenerSocket();
-        return;
-      }
-      res = listener_socket.Bind(kNetworkServerAddress, kNetworkPort);
-      if (res != kSocketOk) {
-        *Log() << "UpdateServer Bind: " << listener_socket.GetLastError();
-        listener_socket = ListenerSocket();
-        return;
-      }
-      res = listener_socket.SetSoNonblocking(true);
-      if (res != kSocketOk) {
-        *Log() << "UpdateServer SetSoNonblocking: " << listener_socket.GetLastError();
-        listener_socket = ListenerSocket();
-        return;
-      }
-    }
-
-    // Try accepting a new connection
-    ConnectionSocket socket = listener_socket.Accept();
-    if (socket.IsValid()) {
-      *Log() << Time() << " UpdateServer accepted a new connection";
-
-      SocketResult res = socket.SetSoNonblocking(true);
-      if (res != kSocketOk) {
-        *Log() << "UpdateServer SetSoNonblocking error: " << socket.GetLastError();
-      } else {
-        connections.emplace_back();
-        Connection &rec = connections.back();
-        rec.Init(std::move(socket), Si32(connections.size()) - 1);
-      }
-    } else {
-      //*Log() << Time() << " UpdateServer no new connections";
-    }
-
-    for (Si32 idx = 0; idx < connections.size(); ++idx) {
-      Connection &rec = connections[idx];
-      if (rec.IsValid()) {
-        rec.Update(this);
-      } else {
-        // TODO: handle the disconnected players character in a way that makes sense
-        Avatar *avatar = avatars.TryGetItem(rec.GetUii());
-        if (avatar) {
-          avatar->connection_idx = std::numeric_limits<Ui32>::max();
-        }
-        if (idx != connections.size() - 1) {
-          rec = std::move(connections[connections.size() - 1]);
-          rec.SetIdx(idx);
-          avatar = avatars.TryGetItem(rec.GetUii());
-          if (avatar) {
-            avatar->connection_idx = idx;
-          }
-        }
-        connections.pop_back();
-      }
-    }
-
-  }
-};
-
-const Si32 kMaxClientCmdBucketSize = 4;
-const double kClientCmdBucketFillDelay = 0.25;
-
-class NetClientState {
-  UniqueItemVector<Avatar> avatars;
-
-  ConnectionSocket socket;
-  ConnState state = kConnStateInvalid;
-  Si32 buffer_used = 0;
-  char buffer[kConnBufferSize];
-  char outgoing[kConnBufferSize];
-  Si32 outgoing_used = 0;
-  Si32 outgoing_sent = 0;
-  Uii uii;
-  double server_time_to_client_time;
-
-  Si32 cmd_bucket = 0;
-  double time_to_fill_bucket_at = 0;
-  NetPlayerCmd next_cmd;
-  bool is_next_cmd_sent = false;
-
-  void HandleMsgRegistrationResponse() {
-    MsgRegistrationResponse m;
-    memcpy(&m, buffer + sizeof(MsgHeader), sizeof(m));
-  }
-  void HandleMsgPong() {
-    MsgPong m;
-    memcpy(&m, buffer + sizeof(MsgHeader), sizeof(m));
-  }
-  void HandleMsgAvatarState() {
-    MsgAvatarState m;
-    memcpy(&m, buffer + sizeof(MsgHeader), sizeof(m));
-  }
-
-  void PrepareOutgoingData() {
-    if (Time() >= time_to_fill_bucket_at) {
-      if (cmd_bucket < kMaxClientCmdBucketSize) {
-        cmd_bucket = cmd_bucket + 1;
-        time_to_fill_bucket_at = Time() + kClientCmdBucketFillDelay;
-      }
-    }
-    if (cmd_bucket) {
-      if (!is_next_cmd_sent) {
-        switch(next_cmd.cmd) {
-          case kPlayerCmdAttack: {
-              MsgHeader h;
-              h.msg_type = kMsgTypePlayerCmdAttack;
-              h.msg_size = sizeof(MsgPlayerCmdAttack);
-              memcpy(outgoing + outgoing_used, &h, sizeof(MsgHeader));
-              outgoing_used += sizeof(MsgHeader);
-              MsgPlayerCmdAttack m;
-              m.avatar_uii = next_cmd.uii.value;
-              m.target_uii = next_cmd.uii.value;
-              memcpy(outgoing + outgoing_used, &m, sizeof(MsgPlayerCmdAttack));
-              outgoing_used += sizeof(m);
-            }
-            break;
-          case kPlayerCmdWalkToPoint:{
-            MsgHeader h;
-            h.msg_type = kMsgTypePlayerCmdWalkToPoint;
-            h.msg_size = sizeof(MsgPlayerCmdWalkToPoint);
-            memcpy(outgoing + outgoing_used, &h, sizeof(MsgHeader));
-            outgoing_used += sizeof(MsgHeader);
-            MsgPlayerCmdWalkToPoint m;
-            m.avatar_uii = next_cmd.uii.value;
-            m.x = next_cmd.pos.x;
-            m.y = next_cmd.pos.y;
-            memcpy(outgoing + outgoing_used, &m, sizeof(MsgPlayerCmdWalkToPoint));
-            outgoing_used += sizeof(m);
-          }
-            break;
-          case kPlayerCmdInteractWithItem:
-            break;
-        }
-        is_next_cmd_sent = true;
-        cmd_bucket--;
-      }
-    }
-  }
-
-  void UpdateClient() {
-    for (Si32 i = 0; i < 128; ++i) {
-      size_t read = 0;
-      size_t bytes_to_read = 0;
-      if (buffer_used < sizeof(MsgHeader)) {
-        bytes_to_read = sizeof(MsgHeader) - buffer_used;
-      } else {
-        MsgHeader h;
-        memcpy(&h, buffer, sizeof(MsgHeader));
-        if (buffer_used < sizeof(MsgHeader) + h.msg_size) {
-          bytes_to_read = h.msg_size - buffer_used;
-        } else {
-          if (h.msg_type >= kMsgTypeCount) {
-            *Log() << Time() << " Message type unknown!";
-          } else if (h.msg_size < g_msg_size[h.msg_type]) {
-            *Log() << Time() << " Message size error!";
-          } else {
-            switch (h.msg_type) {
-              case kMsgTypeRegistrationResponse:
-                HandleMsgRegistrationResponse();
-                break;
-              case kMsgTypePong:
-                HandleMsgPong();
-                break;
-              case kMsgTypeAvatarState:
-                HandleMsgAvatarState();
-                break;
-              default:
-                *Log() << Time() << " Message type error!";
-                break;
-            }
-          }
-          bytes_to_read = sizeof(MsgHeader);
-          buffer_used = 0;
-        }
-      }
-      SocketResult res = socket.Read(buffer + buffer_used, bytes_to_read, &read);
-      buffer_used += read;
-      if (res != kSocketOk) {
-        *Log() << Time() << " UpdateClient Read error: " << socket.GetLastError();
-        if (res == kSocketConnectionReset) {
-          // TODO: handle disconnection in a way that makes sense
-        }
-      } else if (read == 0) {
-        //*Log() << Time() << " UpdateServer g_connections[" << idx << "] read: 0";
-
-        // nothing to read
-        break;
-      }
-    }
-
-    if (outgoing_used == 0) {
-      PrepareOutgoingData();
-    }
-    if (outgoing_sent < outgoing_used && socket.IsValid()) {
-      size_t written = 0;
-      SocketResult res = socket.Write(outgoing + outgoing_sent,
-        outgoing_used - outgoing_sent, &written);
-      if (res != kSocketOk) {
-        *Log() << Time() << " UpdateClient Write error: " << socket.GetLastError();
-      } else {
-        outgoing_sent += written;
-        if (outgoing_sent == outgoing_used) {
-          outgoing_sent = 0;
-          outgoing_used = 0;
-        }
-      }
-    }
-  }
-};
-
-
-void Connection::PrepareOutgoingData(NetServerState *server) {
-  constexpr Si32 kMaxSize = kConnBufferSize - sizeof(MsgAvatarState) - sizeof(MsgHeader);
-  while (outgoing_used < kMaxSize) {
-    if (queue.Length()) {
-      Uii uii = queue.PopFront();
-      Avatar* a = server->avatars.TryGetItem(uii);
-      if (a) {
-        MsgHeader h;
-        h.msg_size = sizeof(MsgAvatarState);
-        h.msg_type = kMsgTypeAvatarState;
-        memcpy(outgoing + outgoing_used, &h, sizeof(MsgHeader));
-        outgoing_used += sizeof(MsgHeader);
-        MsgAvatarState m;
-        m.uii = a->uii;
-        m.state = a->state;
-        m.unit_type = a->unit_type;
-        m.begin_tick = a->begin_tick;
-        m.begin_x = a->begin_pos.x;
-        m.begin_y = a->begin_pos.y;
-        m.duration_ticks = a->end_tick - a->begin_tick;
-        m.end_offset_x = a->end_pos.x - a->begin_pos.x;
-        m.end_offset_y = a->end_pos.y - a->begin_pos.y;
-        m.target_uii = a->target_uii;
-        memcpy(outgoing + outgoing_used, &m, sizeof(MsgHeader));
-        outgoing_used += sizeof(MsgAvatarState);
-      }
-    } else {
-      break;
-    }
-  }
-}
-
-void Connection::Update(NetServerState *server) {
-  size_t read = 0;
-  size_t bytes_to_read = 0;
-  if (buffer_used < sizeof(MsgHeader)) {
-    bytes_to_read = sizeof(MsgHeader) - buffer_used;
-  } else {
-    MsgHeader h;
-    memcpy(&h, buffer, sizeof(MsgHeader));
-    if (buffer_used < sizeof(MsgHeader) + h.msg_size) {
-      bytes_to_read = h.msg_size - buffer_used;
-    } else {
-      if (h.msg_type >= kMsgTypeCount) {
-        *Log() << Time() << " Message type unknown!";
-      } else if (h.msg_size < g_msg_size[h.msg_type]) {
-        *Log() << Time() << " Message size error!";
-      } else {
-        switch (h.msg_type) {
-          case kMsgTypeRegistrationRequest:
-            HandleMsgRegistrationRequest();
-            break;
-          case kMsgTypePing:
-            HandleMsgPing();
-            break;
-          case kMsgTypePlayerCmdWalkToPoint:
-            HandleMsgPlayerCmdWalkToPoint();
-            break;
-          case kMsgTypePlayerCmdInteractWithItem:
-            HandleMsgPlayerCmdInteractWithItem();
-            break;
-          case kMsgTypePlayerCmdAttack:
-            HandleMsgPlayerCmdAttack();
-            break;
-          default:
-            *Log() << Time() << " Message type error!";
-            break;
-        }
-      }
-      bytes_to_read = sizeof(MsgHeader);
-      buffer_used = 0;
-    }
-  }
-  SocketResult res = socket.Read(buffer + buffer_used, bytes_to_read, &read);
-  buffer_used += read;
-  if (res != kSocketOk) {
-    *Log() << Time() << " UpdateServer connections[" << idx << "] Read error: " << socket.GetLastError();
-    if (res == kSocketConnectionReset) {
-      // TODO: handle disconnection in a way that makes sense
-    }
-  } else if (read == 0) {
-    //*Log() << Time() << " UpdateServer g_connections[" << idx << "] read: 0";
-    // nothing to read
-  }
-
-  if (outgoing_used == 0) {
-    PrepareOutgoingData(server);
-  }
-  if (outgoing_sent < outgoing_used && socket.IsValid()) {
-    size_t written = 0;
-    SocketResult res = socket.Write(outgoing + outgoing_sent,
-      outgoing_used - outgoing_sent, &written);
-    if (res != kSocketOk) {
-      *Log() << Time() << " UpdateServer connections[" << idx << "] Write error: " << socket.GetLastError();
-    } else {
-      outgoing_sent += written;
-      if (outgoing_sent == outgoing_used) {
-        outgoing_sent = 0;
-        outgoing_used = 0;
-      }
-    }
-  }
-}
-
 
 bool g_show_variables = false;
 
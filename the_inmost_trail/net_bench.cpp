@@ -0,0 +1,230 @@
+// Copyright (c) <year> Your name
+
+// Networking benchmarks (the_inmost_trail_net_bench), headless like the dedicated server.
+//   idle: the cost of a server tick against the number of connected but idle clients,
+//         with the epoll readiness backend and with the per-connection scan it replaces.
+//   encode: the cost of writing the full state of every avatar to every connection, encoding it
+//           for each connection and copying it out of the AvatarStateCache it replaces.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "engine/log.h"
+#include "world.hpp"
+#include "net_protocol.hpp"
+#include "net_server.hpp"
+
+using namespace arctic;  // NOLINT
+
+constexpr Ui16 kBenchFirstPort = 27100;
+constexpr Ui32 kBenchMapSize = 64;
+
+// Parses "--name=<value>" into *out_value, returns false if arg is not that option
+bool ParseUi32Arg(const char *arg, const char *name, Ui32 *out_value) {
+  size_t name_length = strlen(name);
+  if (strncmp(arg, name, name_length) != 0 || arg[name_length] != '=') {
+    return false;
+  }
+  *out_value = Ui32(atoi(arg + name_length + 1));
+  return true;
+}
+
+#ifdef NET_HAS_EPOLL
+
+// Binds the listener to the loopback, as StartListener would to kNetworkServerAddress
+bool StartBenchListener(NetServerState *server, Ui16 port) {
+  server->listener_socket = ServerListenerSocket(AddressFamily::kIpV4, SocketProtocol::kTcp);
+  if (server->listener_socket.Bind("127.0.0.1", port) != kSocketOk ||
+      server->listener_socket.SetSoNonblocking(true) != kSocketOk) {
+    printf("Bind 127.0.0.1:%u: %s\n", Ui32(port), server->listener_socket.GetLastError().c_str());
+    return false;
+  }
+  server->InitPoller();
+  if (server->IsPollerActive()) {
+    server->poller.Add(server->listener_socket.GetNativeHandle(), kPollerListenerTag);
+  }
+  return true;
+}
+
+int ConnectToLoopback(Ui16 port) {
+  int handle = socket(AF_INET, SOCK_STREAM, 0);
+  if (handle == -1) {
+    return -1;
+  }
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(handle, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    close(handle);
+    return -1;
+  }
+  return handle;
+}
+
+// Average microseconds per tick with connection_count idle clients connected
+double MeasureIdleTick(Ui32 connection_count, bool is_poller_enabled, Ui16 port, Ui32 tick_count) {
+  NetServerState server(kBenchMapSize, kBenchMapSize, kAvatarCount);
+  server.is_poller_enabled = is_poller_enabled;
+  if (!StartBenchListener(&server, port)) {
+    return -1.0;
+  }
+  std::vector<int> clients;
+  clients.reserve(connection_count);
+  bool is_connect_failed = false;
+  while (clients.size() < connection_count && !is_connect_failed) {
+    // No more than the server accepts in a tick, so the listen backlog never fills up
+    for (Ui32 i = 0; i < server.accept_budget && clients.size() < connection_count; ++i) {
+      int handle = ConnectToLoopback(port);
+      if (handle == -1) {
+        printf("connect: %s, measuring %u connections\n", strerror(errno), Ui32(clients.size()));
+        is_connect_failed = true;
+        break;
+      }
+      clients.push_back(handle);
+    }
+    server.UpdateServer();
+  }
+  // Until every connection is accepted and has gone idle
+  while (server.connections.Size() < clients.size()) {
+    server.UpdateServer();
+  }
+  for (Ui32 i = 0; i < 4; ++i) {
+    server.UpdateServer();
+  }
+
+  double begin = NetTime();
+  for (Ui32 i = 0; i < tick_count; ++i) {
+    server.UpdateServer();
+  }
+  double tick_time = (NetTime() - begin) / double(tick_count);
+
+  for (int handle : clients) {
+    close(handle);
+  }
+  return tick_time * 1000000.0;
+}
+
+void BenchIdleConnections(Ui32 max_connection_count, Ui32 tick_count) {
+  // Each connection takes a descriptor on both ends
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < 2 * max_connection_count + 64) {
+      max_connection_count = Ui32((limit.rlim_cur - 64) / 2);
+      printf("descriptor limit %u, testing up to %u connections\n", Ui32(limit.rlim_cur),
+        max_connection_count);
+    }
+  }
+  printf("idle connections   epoll us/tick   scan us/tick\n");
+  Ui16 port = kBenchFirstPort;
+  const Ui32 kCounts[] = {0, 10, 100, 1000, 4000, 10000, 30000};
+  for (Ui32 count : kCounts) {
+    if (count > max_connection_count) {
+      break;
+    }
+    double epoll_time = MeasureIdleTick(count, true, port++, tick_count);
+    double scan_time = MeasureIdleTick(count, false, port++, tick_count);
+    printf("%16u %15.1f %14.1f\n", count, epoll_time, scan_time);
+  }
+}
+
+#endif  // NET_HAS_EPOLL
+
+// Average microseconds per tick to write the state of every avatar for each of
+// connection_count connections, as a tick in which every avatar changed would
+double MeasureEncodeTick(const std::vector<Avatar> &avatars, Ui32 connection_count,
+    bool is_cache_enabled, Ui32 tick_count) {
+  AvatarStateCache cache;
+  std::vector<char> outgoing(avatars.size() * kAvatarStateMsgSize);
+  Ui32 checksum = 0;
+  double begin = NetTime();
+  for (Ui32 tick = 0; tick < tick_count; ++tick) {
+    cache.BeginTick();
+    for (Ui32 connection = 0; connection < connection_count; ++connection) {
+      char *out = outgoing.data();
+      for (const Avatar &a : avatars) {
+        if (is_cache_enabled) {
+          memcpy(out, cache.Get(a), kAvatarStateMsgSize);
+        } else {
+          EncodeAvatarState(a, out);
+        }
+        out += kAvatarStateMsgSize;
+      }
+      checksum += Ui32(Ui8(outgoing[connection % outgoing.size()]));
+    }
+  }
+  double tick_time = (NetTime() - begin) / double(tick_count);
+  // Keeps the writes from being optimized out
+  if (checksum == 0xffffffffu) {
+    printf("%u\n", checksum);
+  }
+  return tick_time * 1000000.0;
+}
+
+void BenchEncode(Ui32 tick_count) {
+  const Ui32 kAvatarsSent = 1000;
+  std::vector<Avatar> avatars(kAvatarsSent);
+  for (Ui32 i = 0; i < kAvatarsSent; ++i) {
+    Avatar &a = avatars[i];
+    a.uii = Uii(i, 1);
+    a.unit_type = 0;
+    a.SetState(kChStateWalkToPoint);
+    a.SetMove(Vec2Si32(Si32(i % kBenchMapSize), Si32(i / kBenchMapSize)),
+      Vec2Si32(Si32(kBenchMapSize - 1), Si32(kBenchMapSize - 1)), i, i + 100);
+    a.SetTarget(kInvalidUii);
+  }
+  printf("%u avatars sent   per-connection encode us/tick   cached us/tick\n", kAvatarsSent);
+  const Ui32 kCounts[] = {1, 10, 100, 1000};
+  for (Ui32 count : kCounts) {
+    double encode_time = MeasureEncodeTick(avatars, count, false, tick_count);
+    double cached_time = MeasureEncodeTick(avatars, count, true, tick_count);
+    printf("%16u %31.1f %16.1f\n", count, encode_time, cached_time);
+  }
+}
+
+// Usage: the_inmost_trail_net_bench [idle] [encode] [--max-connections=<count>] [--ticks=<count>]
+// Runs every benchmark unless some are named.
+int main(int argc, char **argv) {
+  StartLogger();
+  Ui32 max_connection_count = 4000;
+  Ui32 tick_count = 200;
+  bool is_idle_selected = false;
+  bool is_encode_selected = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "idle") == 0) {
+      is_idle_selected = true;
+    } else if (strcmp(argv[i], "encode") == 0) {
+      is_encode_selected = true;
+    } else if (!ParseUi32Arg(argv[i], "--max-connections", &max_connection_count) &&
+        !ParseUi32Arg(argv[i], "--ticks", &tick_count)) {
+      printf("Ignoring unknown argument %s\n", argv[i]);
+    }
+  }
+  bool is_all = !is_idle_selected && !is_encode_selected;
+  tick_count = (tick_count ? tick_count : 1);
+
+  if (is_all || is_idle_selected) {
+#ifdef NET_HAS_EPOLL
+    BenchIdleConnections(max_connection_count, tick_count);
+#else
+    printf("idle: needs the epoll backend, skipped\n");
+#endif
+  }
+  if (is_all || is_encode_selected) {
+    BenchEncode(tick_count);
+  }
+
+  StopLogger();
+  return 0;
+}
@@ -0,0 +1,241 @@
+#include "net_channel.hpp"
+
+#include "engine/arctic_platform_fatal.h"
+
+namespace arctic {
+
+bool IsUdpOpeningPacket(const char *data, Si32 size) {
+  if (!IsUdpPacket(data, size)) {
+    return false;
+  }
+  UdpPacketHeader h = LoadFieldsLe<UdpPacketHeader>(data);
+  const char *reliable = data + sizeof(h);
+  if (h.reliable_first_id != 0 || h.reliable_size > size - Si32(sizeof(h))) {
+    return false;
+  }
+  MsgFrame f;
+  if (!ReadMsgFrame(reliable, h.reliable_size, &f) || f.Size() > h.reliable_size ||
+      !IsMsgValid(f)) {
+    return false;
+  }
+  return f.type == kMsgTypePing || f.type == kMsgTypeRegistrationRequest;
+}
+
+void NetChannel::QueueReliable(const char *data, Si32 size) {
+  const char *p = data;
+  const char *end = data + size;
+  MsgFrame f;
+  while (ReadMsgFrame(p, Si32(end - p), &f)) {
+    Check(f.Size() <= end - p, "NetChannel can't queue a partial message.");
+    Check(f.Size() <= kUdpMaxReliableSize, "NetChannel can't queue a reliable message this long.");
+    reliable_.insert(reliable_.end(), p, p + f.Size());
+    reliable_sizes_.push_back(f.Size());
+    is_reliable_new_ = true;
+    p += f.Size();
+  }
+}
+
+bool NetChannel::IsSendDue(bool has_unreliable, double time) const {
+  if (has_unreliable || is_ack_pending_) {
+    return true;
+  }
+  if (!reliable_sizes_.empty() &&
+      (is_reliable_new_ || time - last_reliable_send_time_ >= kUdpResendDelay)) {
+    return true;
+  }
+  return time - last_send_time_ >= kUdpKeepAliveInterval;
+}
+
+Si32 NetChannel::WritePacket(const char *unreliable, Si32 unreliable_size, double time, char *out) {
+  Check(unreliable_size <= kUdpMaxUnreliableSize, "NetChannel can't write this many unreliable bytes.");
+  UdpPacketHeader h;
+  h.protocol_id = kUdpProtocolId;
+  h.seq = next_seq_++;
+  h.flags = (has_received_ ? kUdpPacketHasAck : 0);
+  h.ack = remote_seq_;
+  h.ack_bits = received_bits_;
+  h.reliable_first_id = oldest_reliable_id_;
+  Si32 reliable_size = 0;
+  Ui16 reliable_count = 0;
+  if (!reliable_sizes_.empty() &&
+      (is_reliable_new_ || time - last_reliable_send_time_ >= kUdpResendDelay)) {
+    for (Si32 size : reliable_sizes_) {
+      if (reliable_size + size > kUdpMaxReliableSize) {
+        break;
+      }
+      reliable_size += size;
+      ++reliable_count;
+    }
+    is_reliable_new_ = false;
+    last_reliable_send_time_ = time;
+  }
+  h.reliable_size = Ui16(reliable_size);
+
+  char *p = out;
+  StoreFieldsLe(p, h);
+  p += sizeof(h);
+  if (reliable_size) {
+    memcpy(p, reliable_.data() + reliable_begin_, size_t(reliable_size));
+    p += reliable_size;
+  }
+  if (unreliable_size) {
+    memcpy(p, unreliable, size_t(unreliable_size));
+    p += unreliable_size;
+  }
+
+  SentPacket &sent = sent_[h.seq % kUdpSentPacketHistory];
+  sent.seq = h.seq;
+  sent.reliable_end_id = Ui16(oldest_reliable_id_ + reliable_count);
+  sent.is_sent = true;
+  sent.is_acked = false;
+  is_ack_pending_ = false;
+  last_send_time_ = time;
+  return Si32(p - out);
+}
+
+void NetChannel::OnPacketAcked(Ui16 seq) {
+  SentPacket &sent = sent_[seq % kUdpSentPacketHistory];
+  if (!sent.is_sent || sent.seq != seq || sent.is_acked) {
+    return;
+  }
+  sent.is_acked = true;
+  newly_acked_.push_back(seq);
+  if (!IsSeqNewer(sent.reliable_end_id, oldest_reliable_id_)) {
+    return;
+  }
+  Ui16 count = Ui16(sent.reliable_end_id - oldest_reliable_id_);
+  for (Ui16 i = 0; i < count; ++i) {
+    reliable_begin_ += reliable_sizes_.front();
+    reliable_sizes_.pop_front();
+  }
+  oldest_reliable_id_ = sent.reliable_end_id;
+  if (reliable_sizes_.empty()) {
+    reliable_.clear();
+    reliable_begin_ = 0;
+  } else {
+    // What was not in the acked packet goes out right away
+    is_reliable_new_ = true;
+    if (size_t(reliable_begin_) * 2 > reliable_.size()) {
+      reliable_.erase(reliable_.begin(), reliable_.begin() + reliable_begin_);
+      reliable_begin_ = 0;
+    }
+  }
+}
+
+bool NetChannel::OnPacketReceived(Ui16 seq, bool *out_is_newest) {
+  *out_is_newest = false;
+  if (!has_received_ || IsSeqNewer(seq, remote_seq_)) {
+    if (has_received_) {
+      Ui32 shift = Ui16(seq - remote_seq_);
+      received_bits_ = (shift < 32 ? (received_bits_ << shift) : 0);
+      if (shift <= 32) {
+        received_bits_ |= Ui32(1) << (shift - 1);
+      }
+    }
+    has_received_ = true;
+    remote_seq_ = seq;
+    *out_is_newest = true;
+    return true;
+  }
+  Ui32 distance = Ui16(remote_seq_ - seq);
+  if (distance == 0 || distance > 32) {
+    return false;
+  }
+  Ui32 bit = Ui32(1) << (distance - 1);
+  if (received_bits_ & bit) {
+    return false;
+  }
+  received_bits_ |= bit;
+  return true;
+}
+
+bool NetChannel::ReadPacket(const char *data, Si32 size, double time, NetChannelInput *out_input) {
+  newly_acked_.clear();
+  *out_input = NetChannelInput();
+  if (!IsUdpPacket(data, size)) {
+    return false;
+  }
+  UdpPacketHeader h = LoadFieldsLe<UdpPacketHeader>(data);
+  const char *reliable = data + sizeof(h);
+  const char *reliable_end = reliable + h.reliable_size;
+  const char *end = data + size;
+  if (h.reliable_size > end - reliable) {
+    return false;
+  }
+
+  // Skip the reliable messages delivered already, the rest is new and in order
+  const char *p = reliable;
+  Ui16 id = h.reliable_first_id;
+  MsgFrame f;
+  while (p < reliable_end && IsSeqNewer(next_remote_reliable_id_, id)) {
+    if (!ReadMsgFrame(p, Si32(reliable_end - p), &f) || f.Size() > reliable_end - p) {
+      return false;
+    }
+    p += f.Size();
+    ++id;
+  }
+  const char *fresh = p;
+  Ui16 fresh_count = 0;
+  if (id == next_remote_reliable_id_) {
+    while (p < reliable_end) {
+      if (!ReadMsgFrame(p, Si32(reliable_end - p), &f) || f.Size() > reliable_end - p) {
+        return false;
+      }
+      p += f.Size();
+      ++fresh_count;
+    }
+  } else {
+    fresh = reliable_end;
+  }
+
+  last_receive_time_ = time;
+  if (h.flags & kUdpPacketHasAck) {
+    for (Si32 i = 31; i >= 0; --i) {
+      if (h.ack_bits & (Ui32(1) << i)) {
+        OnPacketAcked(Ui16(h.ack - 1 - i));
+      }
+    }
+    OnPacketAcked(h.ack);
+  }
+  bool is_newest = false;
+  bool is_first_time = OnPacketReceived(h.seq, &is_newest);
+  if (h.reliable_size || end != reliable_end) {
+    // Ack-only packets are not acked back, or the peers would ping-pong forever
+    is_ack_pending_ = true;
+  }
+  if (!is_first_time) {
+    return true;
+  }
+  out_input->reliable = fresh;
+  out_input->reliable_size = Si32(reliable_end - fresh);
+  next_remote_reliable_id_ = Ui16(next_remote_reliable_id_ + fresh_count);
+  if (is_newest) {
+    out_input->unreliable = reliable_end;
+    out_input->unreliable_size = Si32(end - reliable_end);
+  }
+  return true;
+}
+
+#ifdef NET_HAS_EPOLL
+
+SocketResult NetLinkConditioner::Send(PosixDatagramSocket &socket, const char *data, Si32 size,
+    const NetAddress &address) {
+  if (loss_ > 0.0 && distribution_(random_) < loss_) {
+    return kSocketOk;
+  }
+  if (reorder_ > 0.0 && held_.empty() && distribution_(random_) < reorder_) {
+    held_.assign(data, data + size);
+    held_address_ = address;
+    return kSocketOk;
+  }
+  SocketResult res = socket.SendTo(data, size_t(size), address);
+  if (!held_.empty()) {
+    socket.SendTo(held_.data(), held_.size(), held_address_);
+    held_.clear();
+  }
+  return res;
+}
+
+#endif  // NET_HAS_EPOLL
+
+}  // namespace arctic
@@ -0,0 +1,174 @@
+#ifndef net_channel_hpp
+#define net_channel_hpp
+
+#include <deque>
+#include <random>
+#include <vector>
+#include "engine/arctic_types.h"
+#include "net_protocol.hpp"
+#include "net_socket.hpp"
+
+namespace arctic {
+
+constexpr Ui32 kUdpProtocolId = 0x54495431;
+// Stays under the usual path MTU, so datagrams are never fragmented
+constexpr Si32 kUdpMaxPacketSize = 1200;
+constexpr Si32 kUdpMaxReliableSize = 400;
+constexpr double kUdpResendDelay = 0.1;
+constexpr double kUdpKeepAliveInterval = 1.0;
+constexpr double kUdpTimeout = 10.0;
+constexpr Ui32 kUdpSentPacketHistory = 256;
+constexpr Ui32 kUdpMaxDatagramsPerUpdate = 4096;
+
+enum UdpPacketFlags {
+  kUdpPacketHasAck = 1 << 0
+};
+
+// Starts every datagram, little-endian like the messages
+#pragma pack(push,1)
+struct UdpPacketHeader {
+  Ui32 protocol_id;
+  Ui16 seq;
+  Ui8 flags;
+  // Newest packet received from the peer, bit i of ack_bits is set if ack - 1 - i was received too
+  Ui16 ack;
+  Ui32 ack_bits;
+  // Id of the first of the reliable messages that take the next reliable_size bytes,
+  // the rest of the packet is unreliable messages
+  Ui16 reliable_first_id;
+  Ui16 reliable_size;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&UdpPacketHeader::protocol_id);
+    func(&UdpPacketHeader::seq);
+    func(&UdpPacketHeader::flags);
+    func(&UdpPacketHeader::ack);
+    func(&UdpPacketHeader::ack_bits);
+    func(&UdpPacketHeader::reliable_first_id);
+    func(&UdpPacketHeader::reliable_size);
+  }
+};
+#pragma pack(pop)
+static_assert(ListedFieldsSize<UdpPacketHeader>() == sizeof(UdpPacketHeader),
+  "ForEachField must list every field of UdpPacketHeader");
+
+constexpr Si32 kUdpMaxUnreliableSize = kUdpMaxPacketSize - Si32(sizeof(UdpPacketHeader)) -
+  kUdpMaxReliableSize;
+
+// True if a comes after b, sequence numbers wrap around
+inline bool IsSeqNewer(Ui16 a, Ui16 b) {
+  return Si16(Ui16(a - b)) > 0;
+}
+
+inline bool IsUdpPacket(const char *data, Si32 size) {
+  if (size < Si32(sizeof(UdpPacketHeader))) {
+    return false;
+  }
+  return LoadLe<Ui32>(data) == kUdpProtocolId;
+}
+
+// True if the datagram may open a connection: a well-formed packet that starts the reliable
+// stream with what a client begins with, a ping to synchronise its clock or a registration
+// request. Anything else from an unknown peer can't be the start of a connection.
+bool IsUdpOpeningPacket(const char *data, Si32 size);
+
+// Messages of one received packet, pointing into the packet
+struct NetChannelInput {
+  const char *reliable = nullptr;
+  Si32 reliable_size = 0;
+  const char *unreliable = nullptr;
+  Si32 unreliable_size = 0;
+};
+
+// Selective reliability over datagrams for one peer.
+// Reliable messages are delivered once and in order: every packet that carries them
+// carries all of them from the oldest one the peer has not acknowledged yet, so they
+// are resent until a packet with them is acked and never arrive with a gap.
+// Unreliable messages are sequenced: the ones from a packet older than the newest
+// received are dropped, so a stale snapshot never overwrites a fresh one and a lost
+// one never holds the next back.
+class NetChannel {
+  struct SentPacket {
+    Ui16 seq = 0;
+    Ui16 reliable_end_id = 0;
+    bool is_sent = false;
+    bool is_acked = false;
+  };
+  Ui16 next_seq_ = 0;
+  SentPacket sent_[kUdpSentPacketHistory];
+  // Unacked reliable messages back to back from reliable_begin_, the first has id oldest_reliable_id_
+  std::vector<char> reliable_;
+  Si32 reliable_begin_ = 0;
+  std::deque<Si32> reliable_sizes_;
+  Ui16 oldest_reliable_id_ = 0;
+  bool is_reliable_new_ = false;
+  double last_reliable_send_time_ = 0.0;
+  double last_send_time_ = 0.0;
+
+  bool has_received_ = false;
+  Ui16 remote_seq_ = 0;
+  Ui32 received_bits_ = 0;
+  Ui16 next_remote_reliable_id_ = 0;
+  bool is_ack_pending_ = false;
+  double last_receive_time_ = 0.0;
+  std::vector<Ui16> newly_acked_;
+
+  void OnPacketAcked(Ui16 seq);
+  // Returns false if the packet was received already
+  bool OnPacketReceived(Ui16 seq, bool *out_is_newest);
+ public:
+  explicit NetChannel(double time)
+    : last_send_time_(time)
+    , last_receive_time_(time) {
+  }
+
+  // data must hold whole framed messages
+  void QueueReliable(const char *data, Si32 size);
+  bool HasUnackedReliable() const {
+    return !reliable_sizes_.empty();
+  }
+  bool IsSendDue(bool has_unreliable, double time) const;
+  // unreliable_size must be at most kUdpMaxUnreliableSize, out must have kUdpMaxPacketSize bytes.
+  // Returns the packet size.
+  Si32 WritePacket(const char *unreliable, Si32 unreliable_size, double time, char *out);
+  Ui16 GetLastSentSeq() const {
+    return Ui16(next_seq_ - 1);
+  }
+
+  // Returns false if the packet is malformed
+  bool ReadPacket(const char *data, Si32 size, double time, NetChannelInput *out_input);
+  // Own packets the peer acknowledged in the last ReadPacket, oldest first
+  const std::vector<Ui16>& GetNewlyAcked() const {
+    return newly_acked_;
+  }
+  bool IsTimedOut(double time) const {
+    return time - last_receive_time_ > kUdpTimeout;
+  }
+};
+
+#ifdef NET_HAS_EPOLL
+
+// Simulates a bad network on the sending side, to test over loopback.
+// Drops a packet with the loss probability, with the reorder probability holds it back
+// and sends it right after the next one.
+class NetLinkConditioner {
+  double loss_ = 0.0;
+  double reorder_ = 0.0;
+  std::minstd_rand random_;
+  std::uniform_real_distribution<double> distribution_;
+  std::vector<char> held_;
+  NetAddress held_address_;
+ public:
+  void Configure(double loss, double reorder, Ui32 seed) {
+    loss_ = loss;
+    reorder_ = reorder;
+    random_.seed(seed);
+  }
+  SocketResult Send(PosixDatagramSocket &socket, const char *data, Si32 size, const NetAddress &address);
+};
+
+#endif  // NET_HAS_EPOLL
+
+}  // namespace arctic
+
+#endif /* net_channel_hpp */
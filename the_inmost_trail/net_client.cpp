@@ -0,0 +1,441 @@
+#include "net_client.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "engine/log.h"
+
+namespace arctic {
+
+void ServerClock::AddSample(double c_time, double s_time, double receive_time) {
+  double rtt = receive_time - c_time;
+  if (rtt < 0.0) {
+    return;
+  }
+  Sample &sample = samples_[sample_count_ % kClockSyncSampleCount];
+  sample.time = (c_time + receive_time) * 0.5;
+  sample.offset = s_time - sample.time;
+  sample.rtt = rtt;
+  ++sample_count_;
+
+  Ui32 count = std::min(sample_count_, kClockSyncSampleCount);
+  min_rtt_ = samples_[0].rtt;
+  for (Ui32 i = 1; i < count; ++i) {
+    min_rtt_ = std::min(min_rtt_, samples_[i].rtt);
+  }
+  double max_rtt = min_rtt_ * kClockSyncRttToleranceFactor + kClockSyncRttTolerance;
+  double sum_time = 0.0;
+  double sum_offset = 0.0;
+  double min_time = sample.time;
+  double max_time = sample.time;
+  Ui32 used = 0;
+  for (Ui32 i = 0; i < count; ++i) {
+    if (samples_[i].rtt <= max_rtt) {
+      sum_time += samples_[i].time;
+      sum_offset += samples_[i].offset;
+      min_time = std::min(min_time, samples_[i].time);
+      max_time = std::max(max_time, samples_[i].time);
+      ++used;
+    }
+  }
+  estimate_time_ = sum_time / used;
+  estimate_offset_ = sum_offset / used;
+  if (used >= 3 && max_time - min_time >= kClockDriftMinSpan) {
+    double covariance = 0.0;
+    double variance = 0.0;
+    for (Ui32 i = 0; i < count; ++i) {
+      if (samples_[i].rtt <= max_rtt) {
+        double dt = samples_[i].time - estimate_time_;
+        covariance += dt * (samples_[i].offset - estimate_offset_);
+        variance += dt * dt;
+      }
+    }
+    drift_ = std::max(-kClockMaxDrift, std::min(covariance / variance, kClockMaxDrift));
+  }
+}
+
+void ServerClock::Update(double time) {
+  if (!sample_count_) {
+    return;
+  }
+  double target = estimate_offset_ + drift_ * (time - estimate_time_);
+  if (!is_synced_) {
+    offset_ = target;
+    is_synced_ = (sample_count_ >= kClockSyncMinSamples);
+  } else {
+    double error = target - offset_;
+    double max_step = kClockSlewRate * (time - last_update_time_);
+    if (std::abs(error) > kClockSnapThreshold) {
+      offset_ = target;
+    } else {
+      offset_ += std::max(-max_step, std::min(error, max_step));
+    }
+  }
+  last_update_time_ = time;
+}
+
+void NetClientState::HandleMsg(MsgView<MsgRegistrationResponse> m) {
+  Ui32 result = m.Get(&MsgRegistrationResponse::result);
+  if (result == MsgRegistrationResponse::kResultSuccess) {
+    protocol_version = m.Get(&MsgRegistrationResponse::protocol_version);
+    uii.value = m.Get(&MsgRegistrationResponse::avatar_uii);
+    state = kConnStateRegistered;
+    avatar_state_history.clear();
+    interpolation.Clear();
+    prediction.Reset(tick_duration);
+    next_compact_seq = 1;
+    acked_compact_seq = 0;
+  } else {
+    *Log() << NetTime() << " Registration failed, result: " << result;
+  }
+}
+
+void NetClientState::HandleMsg(MsgView<MsgPong> m) {
+  double time = NetTime();
+  server_clock.AddSample(m.Get(&MsgPong::c_time), m.Get(&MsgPong::s_time), time);
+  server_clock.Update(time);
+  is_ping_in_flight = false;
+  next_ping_time = (server_clock.IsSynced() ? time + kClockSyncInterval : time);
+}
+
+void NetClientState::HandleMsg(MsgView<MsgAvatarState> m) {
+  ApplyAvatarState(LoadAvatarState(m));
+}
+
+void NetClientState::HandleAvatarStateRecord(const char *p, const char *end, Ui32 base_tick) {
+  Ui32 seq = next_compact_seq++;
+  MsgAvatarState m;
+  Ui32 baseline_distance = 0;
+  p = DecodeAvatarStateCompactHeader(p, end, &m.uii, &baseline_distance);
+  if (!p) {
+    *Log() << NetTime() << " AvatarStateCompact is malformed!";
+    return;
+  }
+  AvatarStateHistory &history = avatar_state_history[m.uii.value];
+  MsgAvatarState baseline = MakeEmptyAvatarState(m.uii, base_tick);
+  if (baseline_distance) {
+    Ui32 baseline_seq = seq - baseline_distance;
+    bool is_found = false;
+    for (Ui32 i = 0; i < kCompactStateHistorySize; ++i) {
+      if (history.seq[i] == baseline_seq) {
+        baseline = history.state[i];
+        is_found = true;
+        break;
+      }
+    }
+    if (!is_found) {
+      *Log() << NetTime() << " AvatarStateCompact baseline is missing!";
+      return;
+    }
+  }
+  if (!DecodeAvatarStateCompactFields(p, end, baseline, &m)) {
+    *Log() << NetTime() << " AvatarStateCompact is malformed!";
+    return;
+  }
+  history.seq[history.next] = seq;
+  history.state[history.next] = m;
+  history.next = (history.next + 1) % kCompactStateHistorySize;
+  ApplyAvatarState(m);
+}
+
+void NetClientState::HandleMsg(MsgView<MsgAvatarStateCompact> compact) {
+  HandleAvatarStateRecord(compact.Data(), compact.Data() + compact.Size(), 0);
+}
+
+void NetClientState::HandleMsg(MsgView<MsgAvatarStateBatch> batch) {
+  Ui32 base_tick = batch.Get(&MsgAvatarStateBatch::base_tick);
+  Ui16 count = batch.Get(&MsgAvatarStateBatch::count);
+  next_compact_seq = batch.Get(&MsgAvatarStateBatch::first_seq);
+  const char *p = batch.Data() + sizeof(MsgAvatarStateBatch);
+  const char *end = batch.Data() + batch.Size();
+  for (Ui16 i = 0; i < count; ++i) {
+    Ui32 record_size = 0;
+    p = ReadVarUi32(p, end, &record_size);
+    if (!p || record_size > Ui32(end - p)) {
+      *Log() << NetTime() << " AvatarStateBatch is malformed!";
+      return;
+    }
+    HandleAvatarStateRecord(p, p + record_size, base_tick);
+    p += record_size;
+  }
+}
+
+void NetClientState::HandleMsg(MsgView<MsgAvatarLeave> m) {
+  avatar_state_history.erase(m.Get(&MsgAvatarLeave::uii).value);
+  interpolation.Remove(m.Get(&MsgAvatarLeave::uii));
+}
+
+void NetClientState::HandleMsg(MsgView<MsgPlayerCmdAck> m) {
+  Ui32 seq = m.Get(&MsgPlayerCmdAck::cmd_seq);
+  if (Si32(seq - oldest_unacked_cmd_seq) >= 0 && Si32(seq - sent_cmd_seq) <= 0) {
+    oldest_unacked_cmd_seq = seq + 1;
+  }
+  prediction.Ack(seq, GetPredictionTick());
+}
+
+void NetClientState::HandleMsgError(const char *message) {
+  *Log() << NetTime() << " " << message;
+}
+
+void NetClientState::ApplyAvatarState(const MsgAvatarState &m) {
+  double begin_time = (server_clock.IsSynced() ? TickToClientTime(m.begin_tick) : -1.0);
+  interpolation.Add(m, begin_time, NetTime());
+  if (m.uii == uii && server_clock.IsSynced()) {
+    prediction.SetAuthoritative(m, GetPredictionTick());
+  }
+}
+
+bool NetClientState::QueueCmd(const NetPlayerCmd &cmd) {
+  if (state != kConnStateRegistered) {
+    return false;
+  }
+  Ui32 seq = next_cmd_seq;
+  bool is_last_unsent = (next_cmd_seq - 1 != sent_cmd_seq);
+  if (cmd.cmd == kPlayerCmdWalkToPoint && is_last_unsent &&
+      cmds[(next_cmd_seq - 1) & (kClientCmdRingSize - 1)].cmd == kPlayerCmdWalkToPoint) {
+    // The server would only walk to the new target anyway
+    seq = next_cmd_seq - 1;
+  } else if (next_cmd_seq - oldest_unacked_cmd_seq == kClientCmdRingSize) {
+    return false;
+  } else {
+    ++next_cmd_seq;
+  }
+  cmds[seq & (kClientCmdRingSize - 1)] = cmd;
+  // Without the acks there is no telling when the server has applied the walk
+  if (cmd.cmd == kPlayerCmdWalkToPoint && protocol_version >= kProtocolVersionCmdAck) {
+    double tick = GetPredictionTick();
+    prediction.AddWalk(seq, cmd.pos, Ui32(std::ceil(tick)), tick);
+  }
+  return true;
+}
+
+Si32 NetClientState::WriteCmds(Ui32 first_seq, char *out, Si32 space) {
+  bool is_batch = (protocol_version >= kProtocolVersionCmdBatch);
+  Si32 used = (is_batch ? kMsgExtendedHeaderSize + Si32(sizeof(MsgPlayerCmdBatch)) : 0);
+  MsgPlayerCmdBatch batch;
+  batch.first_seq = first_seq;
+  batch.count = 0;
+  Ui32 seq = first_seq;
+  while (seq != next_cmd_seq && used + kMaxPlayerCmdWireSize <= space &&
+      batch.count < std::numeric_limits<Ui8>::max()) {
+    const NetPlayerCmd &cmd = cmds[seq & (kClientCmdRingSize - 1)];
+    switch (cmd.cmd) {
+      case kPlayerCmdWalkToPoint: {
+          MsgPlayerCmdWalkToPoint m;
+          m.avatar_uii = cmd.my_uii.value;
+          m.x = cmd.pos.x;
+          m.y = cmd.pos.y;
+          used += WriteMsg(out + used, m);
+        }
+        break;
+      case kPlayerCmdInteractWithItem: {
+          MsgPlayerCmdInteractWithItem m;
+          m.avatar_uii = cmd.my_uii.value;
+          m.item_uii = cmd.uii.value;
+          used += WriteMsg(out + used, m);
+        }
+        break;
+      case kPlayerCmdAttack: {
+          MsgPlayerCmdAttack m;
+          m.avatar_uii = cmd.my_uii.value;
+          m.target_uii = cmd.uii.value;
+          used += WriteMsg(out + used, m);
+        }
+        break;
+    }
+    ++seq;
+    ++batch.count;
+  }
+  if (!batch.count) {
+    return 0;
+  }
+  if (Si32(seq - 1 - sent_cmd_seq) > 0) {
+    sent_cmd_seq = seq - 1;
+  }
+  cmd_send_time = NetTime();
+  if (is_batch) {
+    StoreFieldsLe(out + kMsgExtendedHeaderSize, batch);
+    WriteMsgHeaderExtended<MsgPlayerCmdBatch>(out, used - kMsgExtendedHeaderSize);
+  } else if (protocol_version < kProtocolVersionCmdAck) {
+    // Never acked, they are delivered as the stream is reliable
+    oldest_unacked_cmd_seq = seq;
+  }
+  return used;
+}
+
+void NetClientState::PrepareOutgoingData() {
+  // Whatever is still unsent goes first, everything new is appended so that it all
+  // goes out in one write
+  if (outgoing_sent) {
+    memmove(outgoing, outgoing + outgoing_sent, size_t(outgoing_used - outgoing_sent));
+    outgoing_used -= outgoing_sent;
+    outgoing_sent = 0;
+  }
+  double time = NetTime();
+  if (state != kConnStateInvalid &&
+      (is_ping_in_flight ? time - ping_sent_time >= kClockSyncPingTimeout : time >= next_ping_time) &&
+      outgoing_used + MsgWireSize<MsgPing>() <= kConnBufferSize) {
+    MsgPing m;
+    m.c_time = time;
+    outgoing_used += WriteMsg(outgoing + outgoing_used, m);
+    is_ping_in_flight = true;
+    ping_sent_time = time;
+  }
+  // Login waits until the time is synchronised well enough
+  if (state == kConnStateJustConnected && !is_registration_request_sent && server_clock.IsSynced() &&
+      outgoing_used + MsgWireSize<MsgRegistrationRequest>() <= kConnBufferSize) {
+    MsgRegistrationRequest m;
+    m.protocol_version = kProtocolVersion;
+    outgoing_used += WriteMsg(outgoing + outgoing_used, m);
+    is_registration_request_sent = true;
+  }
+  // Over UDP the server learns what arrived from the packet acks
+  if (!channel && next_compact_seq - 1 != acked_compact_seq &&
+      outgoing_used + MsgWireSize<MsgAvatarStateAck>() <= kConnBufferSize) {
+    MsgAvatarStateAck m;
+    m.seq = next_compact_seq - 1;
+    outgoing_used += WriteMsg(outgoing + outgoing_used, m);
+    acked_compact_seq = m.seq;
+  }
+  // Over UDP batches go unreliably in every packet, see UpdateClientUdp,
+  // the commands numbered implicitly must be reliable
+  if (state == kConnStateRegistered && sent_cmd_seq + 1 != next_cmd_seq &&
+      (!channel || protocol_version < kProtocolVersionCmdBatch)) {
+    outgoing_used += WriteCmds(sent_cmd_seq + 1, outgoing + outgoing_used,
+      kConnBufferSize - outgoing_used);
+  }
+}
+
+void NetClientState::HandleIncomingData() {
+  Si32 handled = DispatchMessages(*this, incoming.ReadPtr(), incoming.Length());
+  if (handled == kMsgStreamBroken) {
+    *Log() << NetTime() << " Disconnecting, the server stream is broken";
+    socket = ConnectionSocket();
+    state = kConnStateInvalid;
+    handled = incoming.Length();
+  }
+  incoming.Consume(handled);
+  incoming.Rewind();
+}
+
+bool NetClientState::ConnectUdp(const char *address, Ui16 port) {
+#ifdef NET_HAS_EPOLL
+  if (!ParseNetAddress(address, port, &server_address)) {
+    *Log() << NetTime() << " ConnectUdp can't parse address " << address;
+    return false;
+  }
+  if (udp_socket.Open() != kSocketOk) {
+    *Log() << NetTime() << " ConnectUdp: " << udp_socket.GetLastError();
+    return false;
+  }
+  channel.reset(new NetChannel(NetTime()));
+  state = kConnStateJustConnected;
+  is_registration_request_sent = false;
+  server_clock = ServerClock();
+  oldest_unacked_cmd_seq = 1;
+  next_cmd_seq = 1;
+  sent_cmd_seq = 0;
+  is_ping_in_flight = false;
+  next_ping_time = 0.0;
+  outgoing_used = 0;
+  outgoing_sent = 0;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void NetClientState::SetUdpConditions(double loss, double reorder, Ui32 seed) {
+#ifdef NET_HAS_EPOLL
+  udp_conditioner.Configure(loss, reorder, seed);
+#endif
+}
+
+void NetClientState::UpdateClientUdp() {
+#ifdef NET_HAS_EPOLL
+  char packet[kUdpMaxPacketSize];
+  double time = NetTime();
+  for (Si32 i = 0; i < kClientMaxDatagramsPerUpdate; ++i) {
+    size_t size = 0;
+    NetAddress from;
+    SocketResult res = udp_socket.ReceiveFrom(packet, sizeof(packet), &size, &from);
+    if (res != kSocketOk) {
+      *Log() << NetTime() << " UpdateClient ReceiveFrom error: " << udp_socket.GetLastError();
+      break;
+    }
+    if (size == 0) {
+      break;
+    }
+    NetChannelInput input;
+    if (from == server_address && channel->ReadPacket(packet, Si32(size), time, &input)) {
+      DispatchMessages(*this, input.reliable, input.reliable_size);
+      DispatchMessages(*this, input.unreliable, input.unreliable_size);
+    }
+  }
+
+  PrepareOutgoingData();
+  channel->QueueReliable(outgoing, outgoing_used);
+  outgoing_used = 0;
+  // Every packet carries the unacked commands, so a lost one is made up for by the next
+  // packet instead of waiting for a reliable resend. New commands go out right away.
+  bool has_cmds = (state == kConnStateRegistered && protocol_version >= kProtocolVersionCmdBatch &&
+    oldest_unacked_cmd_seq != next_cmd_seq);
+  bool is_cmd_send_due = has_cmds &&
+    (sent_cmd_seq + 1 != next_cmd_seq || time - cmd_send_time >= kClientCmdResendDelay);
+  if (channel->IsSendDue(is_cmd_send_due, time)) {
+    char cmd_data[kUdpMaxUnreliableSize];
+    Si32 cmd_size = (has_cmds ? WriteCmds(oldest_unacked_cmd_seq, cmd_data, kUdpMaxUnreliableSize) : 0);
+    Si32 size = channel->WritePacket(cmd_data, cmd_size, time, packet);
+    SocketResult res = udp_conditioner.Send(udp_socket, packet, size, server_address);
+    if (res != kSocketOk) {
+      *Log() << NetTime() << " UpdateClient SendTo error: " << udp_socket.GetLastError();
+    }
+  }
+#endif
+}
+
+void NetClientState::UpdateClient() {
+  server_clock.Update(NetTime());
+  interpolation.Update(NetTime());
+  prediction.Update(NetTime());
+  if (channel) {
+    UpdateClientUdp();
+    return;
+  }
+  // Read everything the socket has, a full buffer means there may be more
+  for (Si32 i = 0; i < kClientMaxReadsPerUpdate && socket.IsValid(); ++i) {
+    size_t read = 0;
+    size_t bytes_to_read = size_t(incoming.WriteSpace());
+    SocketResult res = socket.Read(incoming.WritePtr(), bytes_to_read, &read);
+    incoming.CommitWrite(Si32(read));
+    HandleIncomingData();
+    if (res != kSocketOk) {
+      *Log() << NetTime() << " UpdateClient Read error: " << socket.GetLastError();
+      if (res == kSocketConnectionReset) {
+        // TODO: handle disconnection in a way that makes sense
+      }
+      break;
+    } else if (read < bytes_to_read) {
+      // nothing more to read
+      break;
+    }
+  }
+
+  PrepareOutgoingData();
+  if (outgoing_sent < outgoing_used && socket.IsValid()) {
+    size_t written = 0;
+    SocketResult res = socket.Write(outgoing + outgoing_sent,
+      outgoing_used - outgoing_sent, &written);
+    if (res != kSocketOk) {
+      *Log() << NetTime() << " UpdateClient Write error: " << socket.GetLastError();
+    } else {
+      outgoing_sent += written;
+      if (outgoing_sent == outgoing_used) {
+        outgoing_sent = 0;
+        outgoing_used = 0;
+      }
+    }
+  }
+}
+
+}  // namespace arctic
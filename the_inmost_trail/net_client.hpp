@@ -0,0 +1,227 @@
+#ifndef net_client_hpp
+#define net_client_hpp
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include "engine/arctic_types.h"
+#include "engine/arctic_platform_tcpip.h"
+#include "engine/vec2si32.h"
+#include "world.hpp"
+#include "net_protocol.hpp"
+#include "net_channel.hpp"
+#include "net_interpolation.hpp"
+#include "net_prediction.hpp"
+
+namespace arctic {
+
+enum PlayerCmd {
+  kPlayerCmdWalkToPoint = 0,
+  kPlayerCmdInteractWithItem,
+  kPlayerCmdAttack
+};
+
+struct NetPlayerCmd {
+  Uii my_uii;
+  PlayerCmd cmd;
+  Vec2Si32 pos;
+  Uii uii;
+};
+
+constexpr Si32 kClientMaxReadsPerUpdate = 16;
+constexpr Si32 kClientMaxDatagramsPerUpdate = 256;
+// Player commands kept until the server acks them, a power of two
+constexpr Ui32 kClientCmdRingSize = 32;
+static_assert((kClientCmdRingSize & (kClientCmdRingSize - 1)) == 0,
+  "kClientCmdRingSize must be a power of two");
+// Over UDP the unacked commands go out again this often until acked
+constexpr double kClientCmdResendDelay = 0.05;
+constexpr Si32 kMaxPlayerCmdWireSize = std::max(MsgWireSize<MsgPlayerCmdWalkToPoint>(),
+  std::max(MsgWireSize<MsgPlayerCmdInteractWithItem>(), MsgWireSize<MsgPlayerCmdAttack>()));
+
+constexpr Ui32 kClockSyncSampleCount = 16;
+// Round trips after which the time counts as synchronised
+constexpr Ui32 kClockSyncMinSamples = 5;
+// Ping period once synchronised, until then the next ping goes as soon as the pong is back
+constexpr double kClockSyncInterval = 1.0;
+// A ping whose pong did not come back in this time is given up on
+constexpr double kClockSyncPingTimeout = 1.0;
+// Samples whose round trip is within this much of the shortest one are trusted
+constexpr double kClockSyncRttTolerance = 0.002;
+constexpr double kClockSyncRttToleranceFactor = 1.25;
+// Drift is only fitted over samples spanning at least this long
+constexpr double kClockDriftMinSpan = 8.0;
+constexpr double kClockMaxDrift = 0.001;
+// Corrections up to this size are slewed at kClockSlewRate seconds per second,
+// larger ones are applied at once
+constexpr double kClockSnapThreshold = 0.1;
+constexpr double kClockSlewRate = 0.01;
+
+// Estimates the server clock from Ping/Pong round trips.
+// Each round trip gives the server clock offset assuming the way there took as long as
+// the way back, which is off by at most half the round trip time. Round trips much longer
+// than the shortest recent one were held up in some queue, so only the samples close to
+// the shortest are used, and a line fitted over them tracks how the clocks drift apart.
+// Once synchronised the applied offset is slewed towards the estimate, so the mapped
+// times move smoothly instead of jumping with every pong.
+class ServerClock {
+  struct Sample {
+    double time;
+    double offset;
+    double rtt;
+  };
+  Sample samples_[kClockSyncSampleCount];
+  Ui32 sample_count_ = 0;
+  // Estimated server time minus client time is estimate_offset_ at estimate_time_,
+  // changing by drift_ per second
+  double estimate_offset_ = 0.0;
+  double estimate_time_ = 0.0;
+  double drift_ = 0.0;
+  double min_rtt_ = 0.0;
+  double offset_ = 0.0;
+  double last_update_time_ = 0.0;
+  bool is_synced_ = false;
+ public:
+  // c_time and s_time of a pong that arrived at receive_time
+  void AddSample(double c_time, double s_time, double receive_time);
+  // Moves the applied offset towards the estimate, to be called every client update
+  void Update(double time);
+  bool IsSynced() const {
+    return is_synced_;
+  }
+  double GetRtt() const {
+    return min_rtt_;
+  }
+  double GetDrift() const {
+    return drift_;
+  }
+  double ServerToClientTime(double server_time) const {
+    return server_time - offset_;
+  }
+  double ClientToServerTime(double time) const {
+    return time + offset_;
+  }
+};
+
+class NetClientState {
+  UniqueItemVector<Avatar> avatars;
+
+  ConnectionSocket socket;
+  ConnState state = kConnStateInvalid;
+  RecvBuffer incoming;
+  char outgoing[kConnBufferSize];
+  Si32 outgoing_used = 0;
+  Si32 outgoing_sent = 0;
+  Uii uii;
+  ServerClock server_clock;
+  double tick_duration = 1.0 / kDefaultTicksPerSecond;
+  bool is_ping_in_flight = false;
+  double ping_sent_time = 0.0;
+  double next_ping_time = 0.0;
+  Ui32 protocol_version = kProtocolVersionBase;
+  bool is_registration_request_sent = false;
+
+  // Last compact states received for each avatar, used as delta baselines
+  struct AvatarStateHistory {
+    Ui32 seq[kCompactStateHistorySize] = {};
+    MsgAvatarState state[kCompactStateHistorySize];
+    Ui32 next = 0;
+  };
+  std::unordered_map<Ui32, AvatarStateHistory> avatar_state_history;
+  AvatarInterpolationBuffer interpolation;
+  OwnAvatarPredictor prediction;
+  Ui32 next_compact_seq = 1;
+  Ui32 acked_compact_seq = 0;
+
+  // Ring of the player commands from oldest_unacked_cmd_seq to next_cmd_seq, by seq.
+  // The ones after sent_cmd_seq have not been sent yet.
+  NetPlayerCmd cmds[kClientCmdRingSize];
+  Ui32 oldest_unacked_cmd_seq = 1;
+  Ui32 next_cmd_seq = 1;
+  Ui32 sent_cmd_seq = 0;
+  double cmd_send_time = 0.0;
+
+  // Set when talking to the server over UDP, everything the client sends is then reliable
+  std::unique_ptr<NetChannel> channel;
+#ifdef NET_HAS_EPOLL
+  PosixDatagramSocket udp_socket;
+  NetAddress server_address;
+  NetLinkConditioner udp_conditioner;
+#endif
+
+  // Decodes one compact state, p to end is its payload
+  void HandleAvatarStateRecord(const char *p, const char *end, Ui32 base_tick);
+  void ApplyAvatarState(const MsgAvatarState &m);
+  // Writes the commands from first_seq on that fit in space bytes, as one
+  // kMsgTypePlayerCmdBatch or, to servers before kProtocolVersionCmdBatch, one message each.
+  // Returns the number of bytes written.
+  Si32 WriteCmds(Ui32 first_seq, char *out, Si32 space);
+
+  void PrepareOutgoingData();
+  void HandleIncomingData();
+  void UpdateClientUdp();
+
+ public:
+  // Talks to the server over UDP from now on instead of the TCP socket,
+  // returns false if UDP is not supported or the socket can't be opened
+  bool ConnectUdp(const char *address, Ui16 port);
+  // Simulated packet loss and reordering of what the client sends over UDP
+  void SetUdpConditions(double loss, double reorder, Ui32 seed);
+  bool IsRegistered() {
+    return state == kConnStateRegistered;
+  }
+  // The registration request waits for this, as does anything that needs tick times
+  bool IsTimeSynced() {
+    return server_clock.IsSynced();
+  }
+  // Needed if the server runs at other than kDefaultTicksPerSecond
+  void SetTicksPerSecond(Ui32 ticks_per_second) {
+    tick_duration = 1.0 / ticks_per_second;
+  }
+  // NetTime() at which the server tick starts, such as Avatar::begin_tick
+  double TickToClientTime(Ui32 tick) {
+    return server_clock.ServerToClientTime(double(tick) * tick_duration);
+  }
+  // Server tick at NetTime() time, fractional
+  double ClientTimeToTick(double time) {
+    return server_clock.ClientToServerTime(time) / tick_duration;
+  }
+  // The tick avatars are rendered at, a render delay behind the server
+  double GetRenderTick() {
+    return ClientTimeToTick(NetTime() - interpolation.GetDelay());
+  }
+  // The tick the server applies a command sent now at, fractional.
+  // The own avatar is predicted and rendered at this tick, the others at GetRenderTick().
+  double GetPredictionTick() {
+    return ClientTimeToTick(NetTime() + server_clock.GetRtt() * 0.5);
+  }
+  // The avatar as it is to be rendered now, the own one predicted, the others at the
+  // render tick. Returns false if it is not known.
+  bool SampleAvatar(Uii avatar_uii, AvatarSample *out_sample) {
+    if (avatar_uii == uii && prediction.Sample(GetPredictionTick(), out_sample)) {
+      return true;
+    }
+    return interpolation.Sample(avatar_uii, GetRenderTick(),
+      kInterpolationMaxExtrapolation / tick_duration, out_sample);
+  }
+  // Queues the command to be sent with the next update. A walk replaces the walk queued
+  // before it if that one was not sent yet, and is applied to the own avatar right away.
+  // Returns false if not registered or too many commands are waiting for the server.
+  bool QueueCmd(const NetPlayerCmd &cmd);
+
+  // Called by DispatchMessages, m views the message in place in the receive buffer
+  void HandleMsg(MsgView<MsgRegistrationResponse> m);
+  void HandleMsg(MsgView<MsgPong> m);
+  void HandleMsg(MsgView<MsgAvatarState> m);
+  void HandleMsg(MsgView<MsgAvatarStateCompact> m);
+  void HandleMsg(MsgView<MsgAvatarStateBatch> m);
+  void HandleMsg(MsgView<MsgAvatarLeave> m);
+  void HandleMsg(MsgView<MsgPlayerCmdAck> m);
+  void HandleMsgError(const char *message);
+
+  void UpdateClient();
+};
+
+}  // namespace arctic
+
+#endif /* net_client_hpp */
@@ -0,0 +1,117 @@
+#include "net_interpolation.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace arctic {
+
+void AvatarInterpolationBuffer::Add(const MsgAvatarState &m, double begin_time, double time) {
+  Timeline &timeline = timelines_[m.uii.value];
+  if (timeline.count) {
+    Si32 distance = Si32(m.begin_tick - timeline.GetNewest().begin_tick);
+    if (distance < 0) {
+      // Older than what is known already
+      return;
+    }
+    if (distance == 0) {
+      // Same segment, only the state or the target changed, or it was just sent again
+      timeline.segments[(timeline.next + kAvatarTimelineSize - 1) % kAvatarTimelineSize] = m;
+      return;
+    }
+    // A new segment, how late it arrived is how far in the past the avatars must be
+    // rendered for the segments to be there in time. The first segment of an avatar
+    // began whenever, so only the following ones count.
+    if (begin_time >= 0.0) {
+      double lateness = time - begin_time;
+      if (!has_lateness_) {
+        lateness_ = lateness;
+        lateness_deviation_ = 0.0;
+        has_lateness_ = true;
+      } else {
+        double error = lateness - lateness_;
+        lateness_ += error * kInterpolationSmoothing;
+        lateness_deviation_ += (std::abs(error) - lateness_deviation_) * kInterpolationSmoothing;
+      }
+      target_delay_ = std::max(kInterpolationMinDelay, std::min(
+        lateness_ + kInterpolationJitterFactor * lateness_deviation_, kInterpolationMaxDelay));
+    }
+  }
+  timeline.segments[timeline.next] = m;
+  timeline.next = (timeline.next + 1) % kAvatarTimelineSize;
+  timeline.count = std::min(timeline.count + 1, kAvatarTimelineSize);
+}
+
+void AvatarInterpolationBuffer::Remove(Uii uii) {
+  timelines_.erase(uii.value);
+}
+
+void AvatarInterpolationBuffer::Clear() {
+  timelines_.clear();
+}
+
+void AvatarInterpolationBuffer::Update(double time) {
+  double max_step = kInterpolationDelaySlewRate * std::max(time - last_update_time_, 0.0);
+  delay_ += std::max(-max_step, std::min(target_delay_ - delay_, max_step));
+  last_update_time_ = time;
+}
+
+bool AvatarInterpolationBuffer::Sample(Uii uii, double tick, double max_extrapolation_ticks,
+    AvatarSample *out_sample) const {
+  auto it = timelines_.find(uii.value);
+  if (it == timelines_.end() || !it->second.count) {
+    return false;
+  }
+  const Timeline &timeline = it->second;
+  // The newest segment that began by then, or the oldest one if none did
+  Ui32 idx = 0;
+  for (Ui32 i = timeline.count; i > 0; --i) {
+    if (double(timeline.Get(i - 1).begin_tick) <= tick) {
+      idx = i - 1;
+      break;
+    }
+  }
+  const MsgAvatarState &s = timeline.Get(idx);
+  float begin_x = float(s.begin_x);
+  float begin_y = float(s.begin_y);
+  float end_x = begin_x + float(s.end_offset_x);
+  float end_y = begin_y + float(s.end_offset_y);
+  double duration = double(s.duration_ticks);
+  double t = tick - double(s.begin_tick);
+
+  out_sample->unit_type = s.unit_type;
+  out_sample->state = s.state;
+  out_sample->target_uii = s.target_uii;
+  out_sample->is_extrapolated = false;
+  if (t <= 0.0 || duration <= 0.0) {
+    out_sample->pos = (t <= 0.0 ? Vec2F(begin_x, begin_y) : Vec2F(end_x, end_y));
+    return true;
+  }
+  if (t < duration) {
+    float f = float(t / duration);
+    out_sample->pos = Vec2F(begin_x + (end_x - begin_x) * f, begin_y + (end_y - begin_y) * f);
+    return true;
+  }
+  out_sample->pos = Vec2F(end_x, end_y);
+  if (idx + 1 < timeline.count) {
+    // A segment was lost or the avatar stood still in between, bridge the gap to the next one
+    const MsgAvatarState &n = timeline.Get(idx + 1);
+    double gap = double(n.begin_tick) - double(s.begin_tick) - duration;
+    if (gap > 0.0) {
+      float f = float((t - duration) / gap);
+      out_sample->pos = Vec2F(end_x + (float(n.begin_x) - end_x) * f,
+        end_y + (float(n.begin_y) - end_y) * f);
+    }
+    return true;
+  }
+  bool is_walking = (s.state == kChStateWalkToPoint || s.state == kChStateWalkToItem ||
+    s.state == kChStateWalkToAttack);
+  if (is_walking) {
+    // The next segment is late, keep going the same way for a while
+    float over = float(std::min(t - duration, max_extrapolation_ticks) / duration);
+    out_sample->pos = Vec2F(end_x + (end_x - begin_x) * over, end_y + (end_y - begin_y) * over);
+    out_sample->is_extrapolated = (over > 0.f);
+  }
+  return true;
+}
+
+}  // namespace arctic
@@ -0,0 +1,85 @@
+#ifndef net_interpolation_hpp
+#define net_interpolation_hpp
+
+#include <unordered_map>
+#include "engine/arctic_types.h"
+#include "engine/vec2f.h"
+#include "world.hpp"
+#include "net_protocol.hpp"
+
+namespace arctic {
+
+// Received states kept per avatar
+constexpr Ui32 kAvatarTimelineSize = 8;
+constexpr double kInterpolationMinDelay = 0.05;
+constexpr double kInterpolationMaxDelay = 0.5;
+// The render delay covers the average lateness of the updates plus this many deviations
+constexpr double kInterpolationJitterFactor = 4.0;
+constexpr double kInterpolationSmoothing = 0.1;
+// How fast the render delay may change, in seconds per second
+constexpr double kInterpolationDelaySlewRate = 0.05;
+// How long a moving avatar keeps moving past the end of its last segment
+constexpr double kInterpolationMaxExtrapolation = 0.25;
+
+// An avatar as it looked at some moment
+struct AvatarSample {
+  Vec2F pos;
+  Ui8 unit_type = 0;
+  Ui8 state = kChStateIdle;
+  Uii target_uii;
+  // Moved on past the end of the last segment received, as no update came in time
+  bool is_extrapolated = false;
+};
+
+// Client side store of the avatars received from the server.
+// Every MsgAvatarState is a segment of motion: from begin_x/y at begin_tick to
+// begin + end_offset at begin_tick + duration_ticks. The last few segments of each avatar
+// are kept by begin_tick and sampled a render delay in the past, so there is usually
+// a segment covering the sampled moment even when updates are sparse or uneven.
+// The delay follows how late the updates arrive relative to their begin_tick and how
+// much that varies. When the newest segment of a moving avatar ends before the next one
+// arrives, the avatar keeps going for up to kInterpolationMaxExtrapolation.
+class AvatarInterpolationBuffer {
+  struct Timeline {
+    // Ring ordered by begin_tick, newest at next - 1
+    MsgAvatarState segments[kAvatarTimelineSize];
+    Ui32 count = 0;
+    Ui32 next = 0;
+
+    const MsgAvatarState& GetNewest() const {
+      return segments[(next + kAvatarTimelineSize - 1) % kAvatarTimelineSize];
+    }
+    // i = 0 is the oldest
+    const MsgAvatarState& Get(Ui32 i) const {
+      return segments[(next + kAvatarTimelineSize - count + i) % kAvatarTimelineSize];
+    }
+  };
+  std::unordered_map<Ui32, Timeline> timelines_;
+  bool has_lateness_ = false;
+  double lateness_ = 0.0;
+  double lateness_deviation_ = 0.0;
+  double target_delay_ = kInterpolationMinDelay;
+  double delay_ = kInterpolationMinDelay;
+  double last_update_time_ = 0.0;
+ public:
+  // begin_time is when m.begin_tick started on the local clock, time is now.
+  // Pass a negative begin_time while the clocks are not synchronised.
+  void Add(const MsgAvatarState &m, double begin_time, double time);
+  void Remove(Uii uii);
+  void Clear();
+  // Moves the render delay towards what the update lateness calls for
+  void Update(double time);
+  double GetDelay() const {
+    return delay_;
+  }
+  size_t Size() const {
+    return timelines_.size();
+  }
+  // The avatar at the fractional tick, extrapolating up to max_extrapolation_ticks
+  // past its last segment. Returns false if the avatar is unknown.
+  bool Sample(Uii uii, double tick, double max_extrapolation_ticks, AvatarSample *out_sample) const;
+};
+
+}  // namespace arctic
+
+#endif /* net_interpolation_hpp */
@@ -0,0 +1,524 @@
+#include "net_io_workers.hpp"
+
+#ifdef NET_HAS_EPOLL
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include "engine/arctic_platform_fatal.h"
+#include "net_poller.hpp"
+
+namespace arctic {
+
+constexpr Ui32 kNetIoWakeupTag = std::numeric_limits<Ui32>::max();
+constexpr Ui32 kNetIoListenerTag = kNetIoWakeupTag - 1;
+constexpr Ui32 kNetIoMaxEventsPerWait = 1024;
+constexpr double kNetIoWaitTimeout = 0.1;
+
+class NetIoWorker {
+  struct Link {
+    Ui32 link_id;
+    PosixConnectionSocket socket;
+    RecvBuffer incoming;
+    std::deque<NetPacket*> outgoing;
+    Si32 outgoing_sent = 0;
+    bool is_awake = false;
+    bool is_read_drained = false;
+    bool is_write_blocked = false;
+  };
+
+  NetPoller poller_;
+  int wakeup_handle_ = -1;
+  PosixListenerSocket listener_;
+  bool is_listener_ready_ = false;
+  // Ids of the links this worker accepts, they map back to it in NetIoWorkerPool::GetWorker
+  Ui32 first_accepted_link_id_ = 0;
+  Ui32 next_accepted_link_id_ = 0;
+  Ui32 accepted_link_id_step_ = 1;
+  std::thread thread_;
+  std::atomic<bool> is_stop_requested_;
+  std::unordered_map<Ui32, std::unique_ptr<Link>> links_;
+  std::vector<Ui32> awake_links_;
+  std::vector<NetPacket*> free_packets_;
+  std::deque<NetIoEvent> to_sim_pending_;
+
+  void Wake(Link &link) {
+    if (!link.is_awake) {
+      link.is_awake = true;
+      awake_links_.push_back(link.link_id);
+    }
+  }
+
+  void PushToSim(NetIoEventType type, Ui32 link_id, NetPacket *packet) {
+    NetIoEvent e;
+    e.type = type;
+    e.link_id = link_id;
+    e.handle = -1;
+    e.packet = packet;
+    if (!to_sim_pending_.empty() || !to_sim.TryPush(e)) {
+      to_sim_pending_.push_back(e);
+    }
+  }
+
+  NetPacket* AllocPacket() {
+    if (free_packets_.empty()) {
+      return new NetPacket();
+    }
+    NetPacket *packet = free_packets_.back();
+    free_packets_.pop_back();
+    return packet;
+  }
+
+  void HandleEvent(const NetIoEvent &e);
+  void AddLink(Ui32 link_id, int handle);
+  void AcceptLinks();
+  void ReadLink(Link &link);
+  void WriteLink(Link &link);
+  void CloseLink(Link &link);
+  void Run();
+
+ public:
+  SpscQueue<NetIoEvent> to_worker;
+  SpscQueue<NetIoEvent> to_sim;
+  // Owned by the simulation thread, events that did not fit into to_worker yet
+  std::deque<NetIoEvent> to_worker_pending;
+  bool is_wakeup_needed = false;
+
+  NetIoWorker()
+    : is_stop_requested_(false)
+    , to_worker(kNetIoQueueCapacity)
+    , to_sim(kNetIoQueueCapacity) {
+  }
+  ~NetIoWorker();
+
+  // The worker is worker_idx of worker_count
+  bool Start(Ui32 worker_idx, Ui32 worker_count, std::string *out_error);
+  void RequestStop();
+  void Wakeup();
+};
+
+NetIoWorker::~NetIoWorker() {
+  RequestStop();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  // Free whatever is still in flight
+  NetIoEvent e;
+  while (to_worker.TryPop(&e)) {
+    to_worker_pending.push_back(e);
+  }
+  while (to_sim.TryPop(&e)) {
+    to_sim_pending_.push_back(e);
+  }
+  for (NetIoEvent &pending : to_worker_pending) {
+    if (pending.type == kNetIoEventAttach || pending.type == kNetIoEventListen) {
+      close(pending.handle);
+    }
+    delete pending.packet;
+  }
+  for (NetIoEvent &pending : to_sim_pending_) {
+    delete pending.packet;
+  }
+  for (auto &it : links_) {
+    for (NetPacket *packet : it.second->outgoing) {
+      delete packet;
+    }
+  }
+  for (NetPacket *packet : free_packets_) {
+    delete packet;
+  }
+  if (wakeup_handle_ != -1) {
+    close(wakeup_handle_);
+  }
+}
+
+bool NetIoWorker::Start(Ui32 worker_idx, Ui32 worker_count, std::string *out_error) {
+  first_accepted_link_id_ = worker_idx;
+  next_accepted_link_id_ = worker_idx;
+  accepted_link_id_step_ = worker_count;
+  if (!poller_.Init(kNetIoMaxEventsPerWait)) {
+    *out_error = poller_.GetLastError();
+    return false;
+  }
+  wakeup_handle_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeup_handle_ == -1) {
+    *out_error = std::string("eventfd: ") + strerror(errno);
+    return false;
+  }
+  if (!poller_.Add(wakeup_handle_, kNetIoWakeupTag)) {
+    *out_error = poller_.GetLastError();
+    return false;
+  }
+  thread_ = std::thread([this]() { Run(); });
+  return true;
+}
+
+void NetIoWorker::RequestStop() {
+  is_stop_requested_.store(true, std::memory_order_release);
+  Wakeup();
+}
+
+void NetIoWorker::Wakeup() {
+  if (wakeup_handle_ != -1) {
+    Ui64 one = 1;
+    ssize_t res = write(wakeup_handle_, &one, sizeof(one));
+    (void)res;
+  }
+}
+
+void NetIoWorker::HandleEvent(const NetIoEvent &e) {
+  switch (e.type) {
+    case kNetIoEventAttach:
+      AddLink(e.link_id, e.handle);
+      break;
+    case kNetIoEventListen:
+      listener_ = PosixListenerSocket(e.handle);
+      if (!poller_.Add(e.handle, kNetIoListenerTag)) {
+        listener_.Close();
+        break;
+      }
+      is_listener_ready_ = true;
+      break;
+    case kNetIoEventSend: {
+      auto it = links_.find(e.link_id);
+      if (it == links_.end()) {
+        PushToSim(kNetIoEventSent, e.link_id, e.packet);
+        break;
+      }
+      it->second->outgoing.push_back(e.packet);
+      Wake(*it->second);
+      break;
+    }
+    case kNetIoEventRecycle:
+      free_packets_.push_back(e.packet);
+      break;
+    default:
+      break;
+  }
+}
+
+void NetIoWorker::AddLink(Ui32 link_id, int handle) {
+  std::unique_ptr<Link> link(new Link());
+  link->link_id = link_id;
+  link->socket = PosixConnectionSocket(handle);
+  if (!poller_.Add(handle, link_id)) {
+    link->socket.Close();
+    PushToSim(kNetIoEventClosed, link_id, nullptr);
+    return;
+  }
+  Wake(*link);
+  links_[link_id] = std::move(link);
+}
+
+void NetIoWorker::AcceptLinks() {
+  // The listener is edge-triggered, it stays ready until Accept runs out of connections
+  for (Ui32 i = 0; i < kNetIoAcceptsPerWait; ++i) {
+    PosixConnectionSocket socket = listener_.Accept();
+    if (!socket.IsValid()) {
+      is_listener_ready_ = false;
+      return;
+    }
+    if (socket.SetSoNonblocking(true) != kSocketOk) {
+      continue;
+    }
+    Ui32 link_id = next_accepted_link_id_;
+    next_accepted_link_id_ += accepted_link_id_step_;
+    if (next_accepted_link_id_ >= kNetIoListenerTag - accepted_link_id_step_) {
+      next_accepted_link_id_ = first_accepted_link_id_;
+    }
+    // The simulation learns about the link before anything is received from it
+    PushToSim(kNetIoEventAccepted, link_id, nullptr);
+    AddLink(link_id, socket.Release());
+  }
+}
+
+void NetIoWorker::ReadLink(Link &link) {
+  size_t read = 0;
+  size_t bytes_to_read = size_t(link.incoming.WriteSpace());
+  link.socket.Read(link.incoming.WritePtr(), bytes_to_read, &read);
+  link.incoming.CommitWrite(Si32(read));
+  link.is_read_drained = (read < bytes_to_read);
+
+  // Only whole messages of a known type and size get to the simulation thread
+  NetPacket *packet = nullptr;
+  MsgFrame f;
+  while (ReadMsgFrame(link.incoming.ReadPtr(), link.incoming.Length(), &f)) {
+    Si32 size = f.Size();
+    if (size > kConnRecvBufferSize) {
+      // Can never be received whole, the peer is broken
+      link.socket.Close();
+      break;
+    }
+    if (link.incoming.Length() < size) {
+      break;
+    }
+    if (IsMsgValid(f)) {
+      if (!packet) {
+        packet = AllocPacket();
+        packet->link_id = link.link_id;
+        packet->size = 0;
+      }
+      memcpy(packet->data + packet->size, link.incoming.ReadPtr(), size_t(size));
+      packet->size += size;
+    }
+    link.incoming.Consume(size);
+  }
+  link.incoming.Rewind();
+  if (packet) {
+    PushToSim(kNetIoEventMessages, link.link_id, packet);
+  }
+}
+
+void NetIoWorker::WriteLink(Link &link) {
+  while (!link.outgoing.empty() && link.socket.IsValid()) {
+    NetPacket *packet = link.outgoing.front();
+    size_t written = 0;
+    size_t bytes_to_write = size_t(packet->size - link.outgoing_sent);
+    SocketResult res = link.socket.Write(packet->data + link.outgoing_sent, bytes_to_write, &written);
+    if (res != kSocketOk) {
+      break;
+    }
+    link.outgoing_sent += Si32(written);
+    if (written < bytes_to_write) {
+      link.is_write_blocked = true;
+      break;
+    }
+    link.outgoing.pop_front();
+    link.outgoing_sent = 0;
+    PushToSim(kNetIoEventSent, link.link_id, packet);
+  }
+}
+
+void NetIoWorker::CloseLink(Link &link) {
+  // Closing the socket has removed it from the poller already
+  for (NetPacket *packet : link.outgoing) {
+    PushToSim(kNetIoEventSent, link.link_id, packet);
+  }
+  link.outgoing.clear();
+  PushToSim(kNetIoEventClosed, link.link_id, nullptr);
+}
+
+void NetIoWorker::Run() {
+  while (!is_stop_requested_.load(std::memory_order_acquire)) {
+    Si32 event_count = poller_.Wait((awake_links_.empty() && !is_listener_ready_) ?
+      kNetIoWaitTimeout : 0.0);
+    for (Si32 event_idx = 0; event_idx < event_count; ++event_idx) {
+      Ui32 tag = poller_.GetEventTag(event_idx);
+      if (tag == kNetIoWakeupTag) {
+        Ui64 count = 0;
+        ssize_t res = read(wakeup_handle_, &count, sizeof(count));
+        (void)res;
+        continue;
+      }
+      if (tag == kNetIoListenerTag) {
+        is_listener_ready_ = true;
+        continue;
+      }
+      auto it = links_.find(tag);
+      if (it != links_.end()) {
+        Link &link = *it->second;
+        if (poller_.IsEventReadable(event_idx)) {
+          link.is_read_drained = false;
+        }
+        if (poller_.IsEventWritable(event_idx)) {
+          link.is_write_blocked = false;
+        }
+        Wake(link);
+      }
+    }
+
+    NetIoEvent e;
+    while (to_worker.TryPop(&e)) {
+      HandleEvent(e);
+    }
+    if (is_listener_ready_ && listener_.IsValid()) {
+      AcceptLinks();
+    }
+
+    // A link stays awake until its input is drained and its output is flushed or blocked
+    size_t n = 0;
+    while (n < awake_links_.size()) {
+      auto it = links_.find(awake_links_[n]);
+      Link &link = *it->second;
+      if (!link.is_read_drained) {
+        ReadLink(link);
+      }
+      if (!link.is_write_blocked) {
+        WriteLink(link);
+      }
+      bool is_done = false;
+      if (!link.socket.IsValid()) {
+        CloseLink(link);
+        links_.erase(it);
+        is_done = true;
+      } else if (link.is_read_drained && (link.outgoing.empty() || link.is_write_blocked)) {
+        link.is_awake = false;
+        is_done = true;
+      }
+      if (is_done) {
+        awake_links_[n] = awake_links_.back();
+        awake_links_.pop_back();
+      } else {
+        ++n;
+      }
+    }
+
+    while (!to_sim_pending_.empty() && to_sim.TryPush(to_sim_pending_.front())) {
+      to_sim_pending_.pop_front();
+    }
+  }
+}
+
+NetIoWorkerPool::NetIoWorkerPool() {
+}
+
+NetIoWorkerPool::~NetIoWorkerPool() {
+  Stop();
+}
+
+bool NetIoWorkerPool::Start(Ui32 worker_count) {
+  Check(!IsRunning(), "NetIoWorkerPool must be started only once!");
+  for (Ui32 i = 0; i < worker_count; ++i) {
+    std::unique_ptr<NetIoWorker> worker(new NetIoWorker());
+    if (!worker->Start(i, worker_count, &last_error_)) {
+      Stop();
+      return false;
+    }
+    workers_.push_back(std::move(worker));
+  }
+  return IsRunning();
+}
+
+void NetIoWorkerPool::Stop() {
+  for (std::unique_ptr<NetIoWorker> &worker : workers_) {
+    worker->RequestStop();
+  }
+  workers_.clear();
+  for (NetPacket *packet : free_packets_) {
+    delete packet;
+  }
+  free_packets_.clear();
+  pop_worker_ = 0;
+  is_listening_ = false;
+}
+
+bool NetIoWorkerPool::Listen(const char *address, Ui16 port) {
+  Check(IsRunning(), "NetIoWorkerPool must be started before Listen!");
+  Check(!is_listening_, "NetIoWorkerPool must Listen only once!");
+  // Bind them all first, so either every worker listens or none does
+  std::vector<PosixListenerSocket> listeners;
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    listeners.emplace_back(AddressFamily::kIpV4, SocketProtocol::kTcp);
+    PosixListenerSocket &listener = listeners.back();
+    if (!listener.IsValid() ||
+        listener.SetSoLinger(false, 0) != kSocketOk ||
+        listener.SetSoReuseport(true) != kSocketOk ||
+        listener.Bind(address, port) != kSocketOk ||
+        listener.SetSoNonblocking(true) != kSocketOk) {
+      last_error_ = listener.GetLastError();
+      return false;
+    }
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    NetIoEvent e;
+    e.type = kNetIoEventListen;
+    e.link_id = 0;
+    e.handle = listeners[i].Release();
+    e.packet = nullptr;
+    PushToWorker(*workers_[i], e);
+  }
+  Flush();
+  is_listening_ = true;
+  return true;
+}
+
+NetIoWorker& NetIoWorkerPool::GetWorker(Ui32 link_id) {
+  return *workers_[link_id % workers_.size()];
+}
+
+void NetIoWorkerPool::PushToWorker(NetIoWorker &worker, const NetIoEvent &e) {
+  if (!worker.to_worker_pending.empty() || !worker.to_worker.TryPush(e)) {
+    worker.to_worker_pending.push_back(e);
+  }
+  worker.is_wakeup_needed = true;
+}
+
+Ui32 NetIoWorkerPool::Attach(ServerConnectionSocket &&socket) {
+  // The workers number the links they accept themselves
+  Check(!is_listening_, "NetIoWorkerPool can't Attach a socket while the workers are listening.");
+  // Round robin over the workers, GetWorker maps the link id back to its worker
+  Ui32 link_id = next_link_serial_++;
+  if (next_link_serial_ == kNetIoListenerTag) {
+    next_link_serial_ = 0;
+  }
+  NetIoEvent e;
+  e.type = kNetIoEventAttach;
+  e.link_id = link_id;
+  e.handle = socket.Release();
+  e.packet = nullptr;
+  PushToWorker(GetWorker(link_id), e);
+  return link_id;
+}
+
+NetPacket* NetIoWorkerPool::AllocPacket() {
+  if (free_packets_.empty()) {
+    return new NetPacket();
+  }
+  NetPacket *packet = free_packets_.back();
+  free_packets_.pop_back();
+  return packet;
+}
+
+void NetIoWorkerPool::FreePacket(NetPacket *packet) {
+  free_packets_.push_back(packet);
+}
+
+void NetIoWorkerPool::Send(NetPacket *packet) {
+  NetIoEvent e;
+  e.type = kNetIoEventSend;
+  e.link_id = packet->link_id;
+  e.handle = -1;
+  e.packet = packet;
+  PushToWorker(GetWorker(packet->link_id), e);
+}
+
+void NetIoWorkerPool::Recycle(NetPacket *packet) {
+  NetIoEvent e;
+  e.type = kNetIoEventRecycle;
+  e.link_id = packet->link_id;
+  e.handle = -1;
+  e.packet = packet;
+  PushToWorker(GetWorker(packet->link_id), e);
+}
+
+bool NetIoWorkerPool::PopEvent(NetIoEvent *out_event) {
+  while (pop_worker_ < workers_.size()) {
+    if (workers_[pop_worker_]->to_sim.TryPop(out_event)) {
+      return true;
+    }
+    ++pop_worker_;
+  }
+  pop_worker_ = 0;
+  return false;
+}
+
+void NetIoWorkerPool::Flush() {
+  for (std::unique_ptr<NetIoWorker> &worker : workers_) {
+    while (!worker->to_worker_pending.empty() &&
+        worker->to_worker.TryPush(worker->to_worker_pending.front())) {
+      worker->to_worker_pending.pop_front();
+    }
+    if (worker->is_wakeup_needed) {
+      worker->is_wakeup_needed = false;
+      worker->Wakeup();
+    }
+  }
+}
+
+}  // namespace arctic
+
+#endif  // NET_HAS_EPOLL
@@ -0,0 +1,108 @@
+#ifndef net_io_workers_hpp
+#define net_io_workers_hpp
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include "engine/arctic_types.h"
+#include "net_protocol.hpp"
+#include "net_socket.hpp"
+#include "spsc_queue.hpp"
+
+#ifdef NET_HAS_EPOLL
+
+namespace arctic {
+
+constexpr Si32 kNetPacketSize = kConnRecvBufferSize;
+static_assert(kNetPacketSize >= kConnOutgoingBufferSize, "NetPacket must fit a whole outgoing buffer");
+constexpr size_t kNetIoQueueCapacity = 16384;
+// Connections a worker accepts on its listener before it gets back to its links
+constexpr Ui32 kNetIoAcceptsPerWait = 128;
+
+struct NetPacket {
+  Ui32 link_id;
+  Si32 size;
+  char data[kNetPacketSize];
+};
+
+enum NetIoEventType {
+  // Simulation thread to worker
+  kNetIoEventAttach = 0,  // handle is a connected non-blocking socket, from now on known as link_id
+  kNetIoEventSend,  // packet holds bytes to write to link_id
+  kNetIoEventRecycle,  // packet is a kNetIoEventMessages packet the simulation is done with
+  kNetIoEventListen,  // handle is a listening non-blocking socket to accept links from
+  // Worker to simulation thread
+  kNetIoEventMessages,  // packet holds whole, validated messages received from link_id
+  kNetIoEventSent,  // packet is a kNetIoEventSend packet that was written (or dropped, if the link is gone)
+  kNetIoEventClosed,  // link_id was closed by the peer or on error
+  kNetIoEventAccepted  // the worker accepted a new connection on its listener, known as link_id
+};
+
+struct NetIoEvent {
+  NetIoEventType type;
+  Ui32 link_id;
+  int handle;
+  NetPacket *packet;
+};
+
+class NetIoWorker;
+
+// Moves socket reading, message framing and writing off the simulation thread.
+// Each worker thread owns a shard of the connections (links) with its own epoll set,
+// and talks to the simulation thread only through a pair of SpscQueue: commands and
+// outgoing packets go in, received messages, written packets and closures come out.
+// Packets cycle between the threads instead of being allocated per message.
+// All the methods must be called from the simulation thread.
+class NetIoWorkerPool {
+  std::vector<std::unique_ptr<NetIoWorker>> workers_;
+  std::vector<NetPacket*> free_packets_;
+  Ui32 next_link_serial_ = 0;
+  size_t pop_worker_ = 0;
+  bool is_listening_ = false;
+  std::string last_error_;
+
+  NetIoWorker& GetWorker(Ui32 link_id);
+  void PushToWorker(NetIoWorker &worker, const NetIoEvent &e);
+ public:
+  NetIoWorkerPool();
+  NetIoWorkerPool(const NetIoWorkerPool&) = delete;
+  NetIoWorkerPool& operator=(const NetIoWorkerPool&) = delete;
+  ~NetIoWorkerPool();
+
+  bool Start(Ui32 worker_count);
+  void Stop();
+  bool IsRunning() const {
+    return !workers_.empty();
+  }
+  const std::string& GetLastError() const {
+    return last_error_;
+  }
+
+  // Gives every worker a listener of its own, bound to the same address and port
+  // with SO_REUSEPORT, so accepting is spread over the workers too.
+  // The new links come out as kNetIoEventAccepted.
+  bool Listen(const char *address, Ui16 port);
+  bool IsListening() const {
+    return is_listening_;
+  }
+
+  // Hands the socket over to one of the workers, returns its link id.
+  // Can't be used once the workers are listening.
+  Ui32 Attach(ServerConnectionSocket &&socket);
+  NetPacket* AllocPacket();
+  void FreePacket(NetPacket *packet);
+  // The packet comes back as kNetIoEventSent once written
+  void Send(NetPacket *packet);
+  void Recycle(NetPacket *packet);
+  // Returns false when there are no more events for now
+  bool PopEvent(NetIoEvent *out_event);
+  // Delivers what Attach/Send/Recycle queued and wakes the workers up
+  void Flush();
+};
+
+}  // namespace arctic
+
+#endif  // NET_HAS_EPOLL
+
+#endif /* net_io_workers_hpp */
@@ -0,0 +1,74 @@
+#include "net_poller.hpp"
+#include "engine/arctic_platform_fatal.h"
+
+#ifdef NET_HAS_EPOLL
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace arctic {
+
+NetPoller::~NetPoller() {
+  if (epoll_handle_ != -1) {
+    close(epoll_handle_);
+    epoll_handle_ = -1;
+  }
+}
+
+bool NetPoller::Init(Ui32 max_events_per_wait) {
+  Check(epoll_handle_ == -1, "NetPoller must be initialized only once!");
+  epoll_handle_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_handle_ == -1) {
+    last_error_ = std::string("epoll_create1: ") + strerror(errno);
+    return false;
+  }
+  events_.resize(max_events_per_wait);
+  return true;
+}
+
+bool NetPoller::Add(int handle, Ui32 tag) {
+  epoll_event e;
+  e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  e.data.u64 = 0;
+  e.data.u32 = tag;
+  if (epoll_ctl(epoll_handle_, EPOLL_CTL_ADD, handle, &e) != 0) {
+    last_error_ = std::string("epoll_ctl ADD: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool NetPoller::Modify(int handle, Ui32 tag) {
+  epoll_event e;
+  e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  e.data.u64 = 0;
+  e.data.u32 = tag;
+  if (epoll_ctl(epoll_handle_, EPOLL_CTL_MOD, handle, &e) != 0) {
+    last_error_ = std::string("epoll_ctl MOD: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void NetPoller::Remove(int handle) {
+  epoll_event e;
+  memset(&e, 0, sizeof(e));
+  epoll_ctl(epoll_handle_, EPOLL_CTL_DEL, handle, &e);
+}
+
+Si32 NetPoller::Wait(double timeout_seconds) {
+  int timeout_ms = int(timeout_seconds * 1000.0);
+  int res = epoll_wait(epoll_handle_, events_.data(), int(events_.size()), timeout_ms);
+  if (res < 0) {
+    if (errno != EINTR) {
+      last_error_ = std::string("epoll_wait: ") + strerror(errno);
+    }
+    return 0;
+  }
+  return res;
+}
+
+}  // namespace arctic
+
+#endif  // NET_HAS_EPOLL
@@ -0,0 +1,57 @@
+#ifndef net_poller_hpp
+#define net_poller_hpp
+
+#include <vector>
+#include "net_socket.hpp"
+
+#ifdef NET_HAS_EPOLL
+#include <sys/epoll.h>
+
+namespace arctic {
+
+// Edge-triggered readiness notifications for a set of sockets.
+// Every registered socket carries a Ui32 tag that is reported back with its events.
+// As the notifications are edge-triggered, the owner must keep reading (writing)
+// until the socket reports it has nothing more (no more room) before waiting again.
+class NetPoller {
+  int epoll_handle_ = -1;
+  std::vector<epoll_event> events_;
+  std::string last_error_;
+ public:
+  NetPoller() {
+  }
+  NetPoller(const NetPoller&) = delete;
+  NetPoller& operator=(const NetPoller&) = delete;
+  ~NetPoller();
+
+  bool Init(Ui32 max_events_per_wait);
+  bool IsValid() const {
+    return epoll_handle_ != -1;
+  }
+  const std::string& GetLastError() const {
+    return last_error_;
+  }
+
+  bool Add(int handle, Ui32 tag);
+  bool Modify(int handle, Ui32 tag);
+  void Remove(int handle);
+
+  // Waits up to timeout_seconds (0 means do not block) and returns the event count.
+  Si32 Wait(double timeout_seconds);
+
+  Ui32 GetEventTag(Si32 event_idx) const {
+    return events_[event_idx].data.u32;
+  }
+  bool IsEventReadable(Si32 event_idx) const {
+    return (events_[event_idx].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+  }
+  bool IsEventWritable(Si32 event_idx) const {
+    return (events_[event_idx].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0;
+  }
+};
+
+}  // namespace arctic
+
+#endif  // NET_HAS_EPOLL
+
+#endif /* net_poller_hpp */
@@ -0,0 +1,123 @@
+#include "net_prediction.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace arctic {
+
+namespace {
+
+Vec2F GetStatePos(const MsgAvatarState &s, double tick) {
+  Vec2F begin(float(s.begin_x), float(s.begin_y));
+  Vec2F end(begin.x + float(s.end_offset_x), begin.y + float(s.end_offset_y));
+  double t = tick - double(s.begin_tick);
+  if (t <= 0.0) {
+    return begin;
+  }
+  if (t >= double(s.duration_ticks)) {
+    return end;
+  }
+  return begin + (end - begin) * float(t / double(s.duration_ticks));
+}
+
+}  // namespace
+
+void OwnAvatarPredictor::Predict() {
+  predicted_ = authoritative_;
+  for (const PredictedWalk &w : walks_) {
+    Vec2Si32 begin(Si32(predicted_.begin_x), Si32(predicted_.begin_y));
+    Vec2Si32 end(begin.x + predicted_.end_offset_x, begin.y + predicted_.end_offset_y);
+    // A walk the state reflects already can't have been applied before the state began
+    Ui32 tick = (Si32(w.tick - predicted_.begin_tick) > 0 ? w.tick : predicted_.begin_tick);
+    Vec2Si32 pos = GetWalkCellAt(begin, end, predicted_.begin_tick,
+      predicted_.begin_tick + predicted_.duration_ticks, tick);
+    Ui32 duration = GetWalkDurationTicks(pos, w.target, tick_duration_);
+    predicted_.state = kChStateWalkToPoint;
+    predicted_.begin_tick = tick;
+    predicted_.begin_x = Ui32(pos.x);
+    predicted_.begin_y = Ui32(pos.y);
+    predicted_.duration_ticks = Ui16(std::min(duration, Ui32(std::numeric_limits<Ui16>::max())));
+    predicted_.end_offset_x = Si16(w.target.x - pos.x);
+    predicted_.end_offset_y = Si16(w.target.y - pos.y);
+    predicted_.target_uii = kInvalidUii;
+  }
+}
+
+void OwnAvatarPredictor::Repredict(double tick) {
+  Vec2F before = GetStatePos(predicted_, tick) + correction_;
+  Predict();
+  correction_ = before - GetStatePos(predicted_, tick);
+  if (correction_.x * correction_.x + correction_.y * correction_.y >
+      kPredictionSnapDistance * kPredictionSnapDistance) {
+    correction_ = Vec2F(0.f, 0.f);
+  }
+}
+
+void OwnAvatarPredictor::Reset(double tick_duration) {
+  has_authoritative_ = false;
+  walks_.clear();
+  tick_duration_ = tick_duration;
+  correction_ = Vec2F(0.f, 0.f);
+}
+
+void OwnAvatarPredictor::AddWalk(Ui32 cmd_seq, Vec2Si32 target, Ui32 tick, double current_tick) {
+  if (!walks_.empty() && walks_.back().cmd_seq == cmd_seq) {
+    walks_.back().target = target;
+    walks_.back().tick = tick;
+  } else {
+    walks_.push_back(PredictedWalk{cmd_seq, target, tick});
+    if (walks_.size() > kMaxPredictedWalks) {
+      walks_.pop_front();
+    }
+  }
+  if (has_authoritative_) {
+    Repredict(current_tick);
+  }
+}
+
+void OwnAvatarPredictor::Ack(Ui32 cmd_seq, double current_tick) {
+  bool is_changed = false;
+  while (!walks_.empty() && Si32(walks_.front().cmd_seq - cmd_seq) <= 0) {
+    walks_.pop_front();
+    is_changed = true;
+  }
+  // The authoritative state that follows tells where the acked walks went,
+  // if the server dropped them there is none
+  if (is_changed && has_authoritative_) {
+    Repredict(current_tick);
+  }
+}
+
+void OwnAvatarPredictor::SetAuthoritative(const MsgAvatarState &m, double current_tick) {
+  if (has_authoritative_ && Si32(m.begin_tick - authoritative_.begin_tick) < 0) {
+    return;
+  }
+  authoritative_ = m;
+  if (!has_authoritative_) {
+    has_authoritative_ = true;
+    Predict();
+    return;
+  }
+  Repredict(current_tick);
+}
+
+void OwnAvatarPredictor::Update(double time) {
+  double dt = std::max(time - last_update_time_, 0.0);
+  correction_ = correction_ * float(std::exp(-dt / kPredictionCorrectionTime));
+  last_update_time_ = time;
+}
+
+bool OwnAvatarPredictor::Sample(double tick, AvatarSample *out_sample) const {
+  if (!has_authoritative_) {
+    return false;
+  }
+  out_sample->pos = GetStatePos(predicted_, tick) + correction_;
+  out_sample->unit_type = predicted_.unit_type;
+  out_sample->state = predicted_.state;
+  out_sample->target_uii = predicted_.target_uii;
+  out_sample->is_extrapolated = false;
+  return true;
+}
+
+}  // namespace arctic
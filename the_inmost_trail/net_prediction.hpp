@@ -0,0 +1,65 @@
+#ifndef net_prediction_hpp
+#define net_prediction_hpp
+
+#include <deque>
+#include "engine/arctic_types.h"
+#include "engine/vec2f.h"
+#include "engine/vec2si32.h"
+#include "world.hpp"
+#include "net_protocol.hpp"
+#include "net_interpolation.hpp"
+
+namespace arctic {
+
+// Walk commands sent and not acked yet, the oldest are given up on past this
+constexpr size_t kMaxPredictedWalks = 64;
+// Time constant the difference between the old and the corrected prediction decays with
+constexpr double kPredictionCorrectionTime = 0.1;
+// Corrections longer than this, in map cells, are applied at once
+constexpr float kPredictionSnapDistance = 4.f;
+
+// Client side prediction of the player's own avatar.
+// A walk command is applied to the predicted avatar right away, on the tick the server
+// is expected to apply it at, with the same walk model the server uses (GetWalkCellAt).
+// Every authoritative state of the avatar is taken as the new base and the walks the
+// server has not acked yet are applied on top of it again, so the prediction follows
+// the server without losing the commands still on the way. The predicted position moves
+// from the old prediction to the corrected one over kPredictionCorrectionTime.
+class OwnAvatarPredictor {
+  struct PredictedWalk {
+    Ui32 cmd_seq;
+    Vec2Si32 target;
+    Ui32 tick;
+  };
+  MsgAvatarState authoritative_;
+  bool has_authoritative_ = false;
+  // authoritative_ with the unacked walks applied
+  MsgAvatarState predicted_;
+  std::deque<PredictedWalk> walks_;
+  double tick_duration_ = 1.0 / kDefaultTicksPerSecond;
+  // Added to the predicted position, decays to zero
+  Vec2F correction_;
+  double last_update_time_ = 0.0;
+
+  void Predict();
+  // Corrects predicted_, keeping the position at tick where it was
+  void Repredict(double tick);
+ public:
+  void Reset(double tick_duration);
+  // A walk command with number cmd_seq the server is expected to apply on tick,
+  // current_tick is the prediction tick now. A walk with the cmd_seq of the last one
+  // replaces it, as that one was never sent.
+  void AddWalk(Ui32 cmd_seq, Vec2Si32 target, Ui32 tick, double current_tick);
+  // The server has applied the commands up to and including cmd_seq
+  void Ack(Ui32 cmd_seq, double current_tick);
+  // A state of the own avatar from the server, current_tick is the prediction tick now
+  void SetAuthoritative(const MsgAvatarState &m, double current_tick);
+  // Decays the correction
+  void Update(double time);
+  // The avatar at the fractional tick, returns false until the server has sent it
+  bool Sample(double tick, AvatarSample *out_sample) const;
+};
+
+}  // namespace arctic
+
+#endif /* net_prediction_hpp */
@@ -0,0 +1,172 @@
+#include "net_protocol.hpp"
+
+#include <chrono>
+
+namespace arctic {
+
+double NetTime() {
+  static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void EncodeAvatarState(const Avatar &a, char *out) {
+  MsgAvatarState m;
+  m.uii = a.uii;
+  m.state = a.state;
+  m.unit_type = a.unit_type;
+  m.begin_tick = a.begin_tick;
+  m.begin_x = a.begin_pos.x;
+  m.begin_y = a.begin_pos.y;
+  m.duration_ticks = a.end_tick - a.begin_tick;
+  m.end_offset_x = a.end_pos.x - a.begin_pos.x;
+  m.end_offset_y = a.end_pos.y - a.begin_pos.y;
+  m.target_uii = a.target_uii;
+  WriteMsg(out, m);
+}
+
+MsgAvatarState LoadAvatarState(MsgView<MsgAvatarState> v) {
+  MsgAvatarState m;
+  m.uii = v.Get(&MsgAvatarState::uii);
+  m.unit_type = v.Get(&MsgAvatarState::unit_type);
+  m.state = v.Get(&MsgAvatarState::state);
+  m.begin_tick = v.Get(&MsgAvatarState::begin_tick);
+  m.begin_x = v.Get(&MsgAvatarState::begin_x);
+  m.begin_y = v.Get(&MsgAvatarState::begin_y);
+  m.duration_ticks = v.Get(&MsgAvatarState::duration_ticks);
+  m.end_offset_x = v.Get(&MsgAvatarState::end_offset_x);
+  m.end_offset_y = v.Get(&MsgAvatarState::end_offset_y);
+  m.target_uii = v.Get(&MsgAvatarState::target_uii);
+  return m;
+}
+
+MsgAvatarState MakeEmptyAvatarState(Uii uii, Ui32 base_tick) {
+  MsgAvatarState m;
+  m.uii = uii;
+  m.unit_type = 0;
+  m.state = 0;
+  m.begin_tick = base_tick;
+  m.begin_x = 0;
+  m.begin_y = 0;
+  m.duration_ticks = 0;
+  m.end_offset_x = 0;
+  m.end_offset_y = 0;
+  m.target_uii = kInvalidUii;
+  return m;
+}
+
+Si32 EncodeAvatarStateCompact(const MsgAvatarState &m, const MsgAvatarState &baseline,
+    Ui32 baseline_distance, char *out) {
+  Ui8 mask = 0;
+  mask |= (m.unit_type != baseline.unit_type ? kCompactStateUnitType : 0);
+  mask |= (m.state != baseline.state ? kCompactStateState : 0);
+  mask |= (m.begin_tick != baseline.begin_tick ? kCompactStateBeginTick : 0);
+  mask |= (m.begin_x != baseline.begin_x || m.begin_y != baseline.begin_y ? kCompactStateBeginPos : 0);
+  mask |= (m.duration_ticks != baseline.duration_ticks ? kCompactStateDuration : 0);
+  mask |= (m.end_offset_x != baseline.end_offset_x || m.end_offset_y != baseline.end_offset_y ?
+    kCompactStateEndOffset : 0);
+  mask |= (m.target_uii != baseline.target_uii ? kCompactStateTarget : 0);
+
+  char *p = out;
+  p = WriteVarUi32(p, m.uii.value);
+  p = WriteVarUi32(p, baseline_distance);
+  *p++ = char(mask);
+  if (mask & kCompactStateUnitType) {
+    *p++ = char(m.unit_type);
+  }
+  if (mask & kCompactStateState) {
+    *p++ = char(m.state);
+  }
+  if (mask & kCompactStateBeginTick) {
+    p = WriteVarUi32(p, ZigZag(Si32(m.begin_tick - baseline.begin_tick)));
+  }
+  if (mask & kCompactStateBeginPos) {
+    p = WriteVarUi32(p, ZigZag(Si32(m.begin_x - baseline.begin_x)));
+    p = WriteVarUi32(p, ZigZag(Si32(m.begin_y - baseline.begin_y)));
+  }
+  if (mask & kCompactStateDuration) {
+    p = WriteVarUi32(p, ZigZag(Si32(m.duration_ticks) - Si32(baseline.duration_ticks)));
+  }
+  if (mask & kCompactStateEndOffset) {
+    p = WriteVarUi32(p, ZigZag(Si32(m.end_offset_x) - Si32(baseline.end_offset_x)));
+    p = WriteVarUi32(p, ZigZag(Si32(m.end_offset_y) - Si32(baseline.end_offset_y)));
+  }
+  if (mask & kCompactStateTarget) {
+    // Invalid uii turns into 0 and takes one byte
+    p = WriteVarUi32(p, m.target_uii.value + 1);
+  }
+  return Si32(p - out);
+}
+
+const char* DecodeAvatarStateCompactHeader(const char *p, const char *end,
+    Uii *out_uii, Ui32 *out_baseline_distance) {
+  p = ReadVarUi32(p, end, &out_uii->value);
+  if (!p) {
+    return nullptr;
+  }
+  return ReadVarUi32(p, end, out_baseline_distance);
+}
+
+bool DecodeAvatarStateCompactFields(const char *p, const char *end,
+    const MsgAvatarState &baseline, MsgAvatarState *out) {
+  if (p >= end) {
+    return false;
+  }
+  Uii uii = out->uii;
+  *out = baseline;
+  out->uii = uii;
+  Ui8 mask = Ui8(*p++);
+  Ui32 v = 0;
+  if (mask & kCompactStateUnitType) {
+    if (p >= end) {
+      return false;
+    }
+    out->unit_type = Ui8(*p++);
+  }
+  if (mask & kCompactStateState) {
+    if (p >= end) {
+      return false;
+    }
+    out->state = Ui8(*p++);
+  }
+  if (mask & kCompactStateBeginTick) {
+    if (!(p = ReadVarUi32(p, end, &v))) {
+      return false;
+    }
+    out->begin_tick = baseline.begin_tick + Ui32(UnZigZag(v));
+  }
+  if (mask & kCompactStateBeginPos) {
+    if (!(p = ReadVarUi32(p, end, &v))) {
+      return false;
+    }
+    out->begin_x = baseline.begin_x + Ui32(UnZigZag(v));
+    if (!(p = ReadVarUi32(p, end, &v))) {
+      return false;
+    }
+    out->begin_y = baseline.begin_y + Ui32(UnZigZag(v));
+  }
+  if (mask & kCompactStateDuration) {
+    if (!(p = ReadVarUi32(p, end, &v))) {
+      return false;
+    }
+    out->duration_ticks = Ui16(Si32(baseline.duration_ticks) + UnZigZag(v));
+  }
+  if (mask & kCompactStateEndOffset) {
+    if (!(p = ReadVarUi32(p, end, &v))) {
+      return false;
+    }
+    out->end_offset_x = Si16(Si32(baseline.end_offset_x) + UnZigZag(v));
+    if (!(p = ReadVarUi32(p, end, &v))) {
+      return false;
+    }
+    out->end_offset_y = Si16(Si32(baseline.end_offset_y) + UnZigZag(v));
+  }
+  if (mask & kCompactStateTarget) {
+    if (!(p = ReadVarUi32(p, end, &v))) {
+      return false;
+    }
+    out->target_uii.value = v - 1;
+  }
+  return true;
+}
+
+}  // namespace arctic
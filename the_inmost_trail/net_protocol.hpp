@@ -0,0 +1,761 @@
+#ifndef net_protocol_hpp
+#define net_protocol_hpp
+
+#include <string.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "engine/arctic_types.h"
+#include "engine/arctic_platform_fatal.h"
+#include "world.hpp"
+
+namespace arctic {
+
+constexpr const char *kNetworkServerAddress = "176.126.85.38";
+constexpr Ui16 kNetworkPort = 27000;
+
+// Monotonic time in seconds. Unlike Time() it does not need the engine,
+// so it is used by everything the dedicated server links.
+double NetTime();
+
+// Simulation tick rate the clients assume unless told otherwise: tick t starts at
+// server time t / kDefaultTicksPerSecond, the s_time of MsgPong is on that clock
+constexpr Ui32 kDefaultTicksPerSecond = 20;
+
+enum ConnState {
+  kConnStateInvalid = 0,
+  kConnStateJustConnected,
+  kConnStateRegistered
+};
+
+constexpr Si32 kConnBufferSize = 516;
+// Server side outgoing buffer, big enough for a whole batched snapshot of a crowded area
+constexpr Si32 kConnOutgoingBufferSize = 8192;
+
+constexpr Ui32 kProtocolVersionBase = 1;
+// Adds kMsgTypeAvatarStateCompact and kMsgTypeAvatarStateAck
+constexpr Ui32 kProtocolVersionCompactState = 2;
+// Adds extended message sizes and kMsgTypeAvatarStateBatch
+constexpr Ui32 kProtocolVersionStateBatch = 3;
+// Adds kMsgTypePlayerCmdAck, the server applies walk commands
+constexpr Ui32 kProtocolVersionCmdAck = 4;
+// Adds kMsgTypePlayerCmdBatch, the commands are then numbered explicitly
+constexpr Ui32 kProtocolVersionCmdBatch = 5;
+constexpr Ui32 kProtocolVersion = kProtocolVersionCmdBatch;
+
+enum MsgType {
+  kMsgTypeRegistrationRequest = 0,
+  kMsgTypeRegistrationResponse = 1,
+  kMsgTypePing = 2,
+  kMsgTypePong = 3,
+  kMsgTypePlayerCmdWalkToPoint = 4,
+  kMsgTypePlayerCmdInteractWithItem = 5,
+  kMsgTypePlayerCmdAttack = 6,
+  kMsgTypeAvatarState = 7,
+  kMsgTypeAvatarLeave = 8,
+  kMsgTypeAvatarStateCompact = 9,
+  kMsgTypeAvatarStateAck = 10,
+  kMsgTypeAvatarStateBatch = 11,
+  kMsgTypePlayerCmdAck = 12,
+  kMsgTypePlayerCmdBatch = 13,
+  kMsgTypeCount
+};
+
+// Message structs are the layout of their payload on the wire, with every multi-byte field
+// little-endian. ForEachField lists the fields in order for WriteMsg and MsgView to convert.
+#pragma pack(push,1)
+struct MsgHeader {
+  Ui8 msg_size;
+  Ui8 msg_type;
+};
+struct MsgRegistrationRequest {
+  static constexpr MsgType kType = kMsgTypeRegistrationRequest;
+  Ui32 protocol_version;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgRegistrationRequest::protocol_version);
+  }
+};
+struct MsgRegistrationResponse {
+  static constexpr MsgType kType = kMsgTypeRegistrationResponse;
+  enum Result {
+    kResultSuccess = 0,
+    kResultUnknownError = 1,
+    kResultProtocolVersionMismatch = 2
+  };
+  Ui32 protocol_version;
+  Ui32 result;
+  Ui32 avatar_uii;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgRegistrationResponse::protocol_version);
+    func(&MsgRegistrationResponse::result);
+    func(&MsgRegistrationResponse::avatar_uii);
+  }
+};
+struct MsgPing {
+  static constexpr MsgType kType = kMsgTypePing;
+  double c_time;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgPing::c_time);
+  }
+};
+struct MsgPong {
+  static constexpr MsgType kType = kMsgTypePong;
+  double c_time;
+  double s_time;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgPong::c_time);
+    func(&MsgPong::s_time);
+  }
+};
+struct MsgPlayerCmdWalkToPoint {
+  static constexpr MsgType kType = kMsgTypePlayerCmdWalkToPoint;
+  Ui32 avatar_uii;
+  Ui32 x;
+  Ui32 y;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgPlayerCmdWalkToPoint::avatar_uii);
+    func(&MsgPlayerCmdWalkToPoint::x);
+    func(&MsgPlayerCmdWalkToPoint::y);
+  }
+};
+struct MsgPlayerCmdInteractWithItem {
+  static constexpr MsgType kType = kMsgTypePlayerCmdInteractWithItem;
+  Ui32 avatar_uii;
+  Ui32 item_uii;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgPlayerCmdInteractWithItem::avatar_uii);
+    func(&MsgPlayerCmdInteractWithItem::item_uii);
+  }
+};
+struct MsgPlayerCmdAttack {
+  static constexpr MsgType kType = kMsgTypePlayerCmdAttack;
+  Ui32 avatar_uii;
+  Ui32 target_uii;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgPlayerCmdAttack::avatar_uii);
+    func(&MsgPlayerCmdAttack::target_uii);
+  }
+};
+struct MsgAvatarState {
+  static constexpr MsgType kType = kMsgTypeAvatarState;
+  Uii uii;
+  Ui8 unit_type;
+  Ui8 state;
+  Ui32 begin_tick;
+  Ui32 begin_x;
+  Ui32 begin_y;
+  Ui16 duration_ticks;
+  Si16 end_offset_x;
+  Si16 end_offset_y;
+  Uii target_uii;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgAvatarState::uii);
+    func(&MsgAvatarState::unit_type);
+    func(&MsgAvatarState::state);
+    func(&MsgAvatarState::begin_tick);
+    func(&MsgAvatarState::begin_x);
+    func(&MsgAvatarState::begin_y);
+    func(&MsgAvatarState::duration_ticks);
+    func(&MsgAvatarState::end_offset_x);
+    func(&MsgAvatarState::end_offset_y);
+    func(&MsgAvatarState::target_uii);
+  }
+};
+struct MsgAvatarLeave {
+  static constexpr MsgType kType = kMsgTypeAvatarLeave;
+  Uii uii;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgAvatarLeave::uii);
+  }
+};
+// Variable size, see EncodeAvatarStateCompact
+struct MsgAvatarStateCompact {
+  static constexpr MsgType kType = kMsgTypeAvatarStateCompact;
+  Ui8 min_payload[3];
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgAvatarStateCompact::min_payload);
+  }
+};
+struct MsgAvatarStateAck {
+  static constexpr MsgType kType = kMsgTypeAvatarStateAck;
+  Ui32 seq;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgAvatarStateAck::seq);
+  }
+};
+// Variable size, followed by count records of varint record size + compact state payload.
+// The records are compact states number first_seq, first_seq + 1...
+struct MsgAvatarStateBatch {
+  static constexpr MsgType kType = kMsgTypeAvatarStateBatch;
+  Ui32 base_tick;
+  Ui32 first_seq;
+  Ui16 count;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgAvatarStateBatch::base_tick);
+    func(&MsgAvatarStateBatch::first_seq);
+    func(&MsgAvatarStateBatch::count);
+  }
+};
+// Player commands (kMsgTypePlayerCmd*) are numbered 1, 2, 3... in the order they are sent.
+// Sent alone they go over a reliable ordered stream and are numbered implicitly, so both
+// sides count the same. The server acknowledges the number of the last command it has applied.
+struct MsgPlayerCmdAck {
+  static constexpr MsgType kType = kMsgTypePlayerCmdAck;
+  Ui32 cmd_seq;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgPlayerCmdAck::cmd_seq);
+  }
+};
+// Variable size, followed by count whole kMsgTypePlayerCmd* messages, header and payload,
+// numbered first_seq, first_seq + 1... The server skips the ones it has seen already,
+// so a batch may be sent again, or unreliably in every packet until acked.
+struct MsgPlayerCmdBatch {
+  static constexpr MsgType kType = kMsgTypePlayerCmdBatch;
+  Ui32 first_seq;
+  Ui8 count;
+  template <class Func>
+  static constexpr void ForEachField(Func &func) {
+    func(&MsgPlayerCmdBatch::first_seq);
+    func(&MsgPlayerCmdBatch::count);
+  }
+};
+#pragma pack(pop)
+
+// Multi-byte fields go over the wire little-endian
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr bool kIsHostBigEndian = true;
+#else
+constexpr bool kIsHostBigEndian = false;
+#endif
+
+// Reads a little-endian F from possibly unaligned memory.
+// On little-endian hosts it compiles to a single load.
+template <class F>
+F LoadLe(const char *p) {
+  static_assert(std::is_trivially_copyable<F>::value, "LoadLe needs a plain value type");
+  F value;
+  if (kIsHostBigEndian) {
+    char bytes[sizeof(F)];
+    for (size_t i = 0; i < sizeof(F); ++i) {
+      bytes[i] = p[sizeof(F) - 1 - i];
+    }
+    memcpy(&value, bytes, sizeof(F));
+  } else {
+    memcpy(&value, p, sizeof(F));
+  }
+  return value;
+}
+
+// Writes F little-endian to possibly unaligned memory, the counterpart of LoadLe
+template <class F>
+void StoreLe(char *p, F value) {
+  static_assert(std::is_trivially_copyable<F>::value, "StoreLe needs a plain value type");
+  if (kIsHostBigEndian) {
+    char bytes[sizeof(F)];
+    memcpy(bytes, &value, sizeof(F));
+    for (size_t i = 0; i < sizeof(F); ++i) {
+      p[i] = bytes[sizeof(F) - 1 - i];
+    }
+  } else {
+    memcpy(p, &value, sizeof(F));
+  }
+}
+
+template <class T, class F>
+size_t FieldOffset(const T &m, F T::*field) {
+  return size_t(reinterpret_cast<const char*>(&(m.*field)) - reinterpret_cast<const char*>(&m));
+}
+
+// Writes every field T::ForEachField lists to out in the layout of T, little-endian
+template <class T>
+void StoreFieldsLe(char *out, const T &m) {
+  auto store = [&](auto field) {
+    StoreLe(out + FieldOffset(m, field), m.*field);
+  };
+  T::ForEachField(store);
+}
+
+// Reads a T written by StoreFieldsLe
+template <class T>
+T LoadFieldsLe(const char *p) {
+  T m;
+  auto load = [&](auto field) {
+    typedef typename std::remove_reference<decltype(m.*field)>::type F;
+    m.*field = LoadLe<F>(p + FieldOffset(m, field));
+  };
+  T::ForEachField(load);
+  return m;
+}
+
+// Total size of the fields T::ForEachField lists, sizeof(T) if none is missing
+template <class T>
+struct FieldSizeSum {
+  size_t size = 0;
+  template <class F>
+  constexpr void operator()(F T::*) {
+    size += sizeof(F);
+  }
+};
+
+template <class T>
+constexpr size_t ListedFieldsSize() {
+  FieldSizeSum<T> sum;
+  T::ForEachField(sum);
+  return sum.size;
+}
+
+// Message registry: every message struct in MsgType order. The size table,
+// encoding and the dispatch jump table are generated from this list, so a new
+// message needs its MsgType, its struct with kType and ForEachField and an entry here.
+template <class... Ts>
+struct MsgList {
+};
+
+typedef MsgList<
+  MsgRegistrationRequest,
+  MsgRegistrationResponse,
+  MsgPing,
+  MsgPong,
+  MsgPlayerCmdWalkToPoint,
+  MsgPlayerCmdInteractWithItem,
+  MsgPlayerCmdAttack,
+  MsgAvatarState,
+  MsgAvatarLeave,
+  MsgAvatarStateCompact,
+  MsgAvatarStateAck,
+  MsgAvatarStateBatch,
+  MsgPlayerCmdAck,
+  MsgPlayerCmdBatch> AllMsgs;
+
+// Messages whose payload may be longer than the struct
+template <class T>
+struct MsgIsVariableSize : std::false_type {
+};
+template <>
+struct MsgIsVariableSize<MsgAvatarStateCompact> : std::true_type {
+};
+template <>
+struct MsgIsVariableSize<MsgAvatarStateBatch> : std::true_type {
+};
+template <>
+struct MsgIsVariableSize<MsgPlayerCmdBatch> : std::true_type {
+};
+
+inline bool IsPlayerCmdMsg(Ui8 type) {
+  return type == kMsgTypePlayerCmdWalkToPoint || type == kMsgTypePlayerCmdInteractWithItem ||
+    type == kMsgTypePlayerCmdAttack;
+}
+
+// A message with a payload of kMsgSizeExtended bytes or more has msg_size set to
+// kMsgSizeExtended and its real payload size right after the header, as a Ui16
+constexpr Ui8 kMsgSizeExtended = 255;
+constexpr Si32 kMsgExtendedHeaderSize = Si32(sizeof(MsgHeader) + sizeof(Ui16));
+constexpr Si32 kConnRecvBufferSize = 8192;
+// Every message must fit the receive buffer whole
+constexpr Si32 kMaxMsgPayloadSize = kConnRecvBufferSize - kMsgExtendedHeaderSize;
+
+template <class List>
+struct MsgTable;
+
+template <class... Ts>
+struct MsgTable<MsgList<Ts...>> {
+  static constexpr Ui32 kCount = sizeof...(Ts);
+  // Minimal payload size by MsgType
+  static constexpr Ui8 kMinSize[sizeof...(Ts)] = {Ui8(sizeof(Ts))...};
+
+  static constexpr bool IsInTypeOrder() {
+    const Ui32 types[] = {Ui32(Ts::kType)...};
+    for (Ui32 i = 0; i < sizeof...(Ts); ++i) {
+      if (types[i] != i) {
+        return false;
+      }
+    }
+    return true;
+  }
+  static constexpr bool IsEveryMsgPacked() {
+    const bool is_packed[] = {(alignof(Ts) == 1)...};
+    for (bool b : is_packed) {
+      if (!b) {
+        return false;
+      }
+    }
+    return true;
+  }
+  static constexpr bool IsEveryMsgPlain() {
+    const bool is_plain[] = {std::is_trivially_copyable<Ts>::value...};
+    for (bool b : is_plain) {
+      if (!b) {
+        return false;
+      }
+    }
+    return true;
+  }
+  static constexpr bool IsEveryFieldListed() {
+    const bool is_listed[] = {(ListedFieldsSize<Ts>() == sizeof(Ts))...};
+    for (bool b : is_listed) {
+      if (!b) {
+        return false;
+      }
+    }
+    return true;
+  }
+  static constexpr bool IsEverySizeInRange() {
+    const size_t sizes[] = {sizeof(Ts)...};
+    for (size_t size : sizes) {
+      if (size >= kMsgSizeExtended) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+template <class... Ts>
+constexpr Ui8 MsgTable<MsgList<Ts...>>::kMinSize[sizeof...(Ts)];
+
+typedef MsgTable<AllMsgs> AllMsgTable;
+
+static_assert(AllMsgTable::kCount == kMsgTypeCount, "Every MsgType must be listed in AllMsgs");
+static_assert(AllMsgTable::IsInTypeOrder(), "AllMsgs must list the messages in MsgType order");
+static_assert(AllMsgTable::IsEveryMsgPacked(), "Message structs must be inside #pragma pack(push,1)");
+static_assert(AllMsgTable::IsEveryMsgPlain(), "Message structs must be trivially copyable");
+static_assert(AllMsgTable::IsEveryFieldListed(), "ForEachField must list every field of a message");
+static_assert(AllMsgTable::IsEverySizeInRange(), "Message structs must fit MsgHeader::msg_size");
+
+struct MsgFrame {
+  Ui8 type;
+  Si32 header_size;
+  Si32 payload_size;
+
+  Si32 Size() const {
+    return header_size + payload_size;
+  }
+};
+
+// Reads the header at data, returns false if the length bytes available are not enough for it
+inline bool ReadMsgFrame(const char *data, Si32 length, MsgFrame *out_frame) {
+  if (length < Si32(sizeof(MsgHeader))) {
+    return false;
+  }
+  const MsgHeader &h = *reinterpret_cast<const MsgHeader*>(data);
+  out_frame->type = h.msg_type;
+  if (h.msg_size != kMsgSizeExtended) {
+    out_frame->header_size = Si32(sizeof(MsgHeader));
+    out_frame->payload_size = h.msg_size;
+    return true;
+  }
+  if (length < kMsgExtendedHeaderSize) {
+    return false;
+  }
+  out_frame->header_size = kMsgExtendedHeaderSize;
+  out_frame->payload_size = Si32(LoadLe<Ui16>(data + sizeof(MsgHeader)));
+  return true;
+}
+
+inline bool IsMsgValid(const MsgFrame &f) {
+  return f.type < kMsgTypeCount && f.payload_size >= AllMsgTable::kMinSize[f.type] &&
+    f.payload_size <= kMaxMsgPayloadSize;
+}
+
+template <class T>
+constexpr Si32 MsgWireSize() {
+  return Si32(sizeof(MsgHeader) + sizeof(T));
+}
+
+// Writes the header of a T with a payload_size bytes payload, returns where the payload goes.
+// payload_size must be less than kMsgSizeExtended.
+template <class T>
+char* WriteMsgHeader(char *out, Si32 payload_size) {
+  MsgHeader *h = reinterpret_cast<MsgHeader*>(out);
+  h->msg_size = Ui8(payload_size);
+  h->msg_type = T::kType;
+  return out + sizeof(MsgHeader);
+}
+
+// Same with the extended size, always kMsgExtendedHeaderSize bytes long, so the header
+// can be written after the payload of any size up to kMaxMsgPayloadSize
+template <class T>
+char* WriteMsgHeaderExtended(char *out, Si32 payload_size) {
+  MsgHeader *h = reinterpret_cast<MsgHeader*>(out);
+  h->msg_size = kMsgSizeExtended;
+  h->msg_type = T::kType;
+  StoreLe(out + sizeof(MsgHeader), Ui16(payload_size));
+  return out + kMsgExtendedHeaderSize;
+}
+
+// Writes header and payload, returns the number of bytes written
+template <class T>
+Si32 WriteMsg(char *out, const T &m) {
+  static_assert(!MsgIsVariableSize<T>::value, "Variable size messages are written with WriteMsgHeader");
+  StoreFieldsLe(WriteMsgHeader<T>(out, sizeof(T)), m);
+  return MsgWireSize<T>();
+}
+
+// Read-only view of a T payload right in the receive buffer, nothing is copied until
+// a field is read: Ui32 seq = view.Get(&MsgAvatarStateAck::seq);
+template <class T>
+class MsgView {
+  const char *payload_;
+  Si32 size_;
+ public:
+  MsgView(const char *payload, Si32 size)
+    : payload_(payload)
+    , size_(size) {
+  }
+  template <class F>
+  F Get(F T::*field) const {
+    const T *m = reinterpret_cast<const T*>(payload_);
+    return LoadLe<F>(reinterpret_cast<const char*>(&(m->*field)));
+  }
+  // The whole payload, at least sizeof(T) bytes, more for variable size messages
+  const char* Data() const {
+    return payload_;
+  }
+  Si32 Size() const {
+    return size_;
+  }
+};
+
+// Calls handler.HandleMsg(MsgView<T> m) for the message in place in the receive buffer.
+// Messages the handler has no HandleMsg for go to HandleMsgError.
+template <class Handler, class T, class = void>
+struct MsgInvoker {
+  static void Invoke(Handler &handler, const char *, Si32) {
+    handler.HandleMsgError("Message type error!");
+  }
+};
+
+template <class Handler, class T>
+struct MsgInvoker<Handler, T,
+    decltype(std::declval<Handler&>().HandleMsg(std::declval<MsgView<T>>()))> {
+  static void Invoke(Handler &handler, const char *payload, Si32 size) {
+    handler.HandleMsg(MsgView<T>(payload, size));
+  }
+};
+
+// Jump table from MsgType to the handler of each message
+template <class Handler, class List>
+struct MsgDispatcher;
+
+template <class Handler, class... Ts>
+struct MsgDispatcher<Handler, MsgList<Ts...>> {
+  typedef void (*Func)(Handler &handler, const char *payload, Si32 size);
+  static constexpr Func kTable[sizeof...(Ts)] = {&MsgInvoker<Handler, Ts>::Invoke...};
+};
+
+template <class Handler, class... Ts>
+constexpr typename MsgDispatcher<Handler, MsgList<Ts...>>::Func
+  MsgDispatcher<Handler, MsgList<Ts...>>::kTable[sizeof...(Ts)];
+
+// Returned by DispatchMessages for a stream holding a message too long to ever be received
+// whole. Nothing after it can be framed, so the connection is to be closed.
+constexpr Si32 kMsgStreamBroken = -1;
+
+// Handles every whole message in data, returns the number of bytes handled or kMsgStreamBroken
+template <class Handler>
+Si32 DispatchMessages(Handler &handler, const char *data, Si32 size) {
+  Si32 handled = 0;
+  MsgFrame f;
+  while (ReadMsgFrame(data + handled, size - handled, &f)) {
+    if (f.payload_size > kMaxMsgPayloadSize) {
+      // Would never fit the receive buffer
+      handler.HandleMsgError("Message too long!");
+      return kMsgStreamBroken;
+    }
+    if (size - handled < f.Size()) {
+      break;
+    }
+    if (f.type >= kMsgTypeCount) {
+      handler.HandleMsgError("Message type unknown!");
+    } else if (f.payload_size < AllMsgTable::kMinSize[f.type]) {
+      handler.HandleMsgError("Message size error!");
+    } else {
+      MsgDispatcher<Handler, AllMsgs>::kTable[f.type](handler,
+        data + handled + f.header_size, f.payload_size);
+    }
+    handled += f.Size();
+  }
+  return handled;
+}
+
+// Receive buffer that takes whatever the socket has in one Read and lets the
+// caller parse every complete message straight out of it.
+// Works as a ring that is rewound instead of wrapping: after parsing, the
+// unfinished tail (less than one message) is moved back to the front,
+// so every message is always contiguous in memory.
+class RecvBuffer {
+  Si32 begin_ = 0;
+  Si32 end_ = 0;
+  char data_[kConnRecvBufferSize];
+ public:
+  char* WritePtr() {
+    return data_ + end_;
+  }
+  Si32 WriteSpace() {
+    return kConnRecvBufferSize - end_;
+  }
+  void CommitWrite(Si32 size) {
+    Check(size <= WriteSpace(), "RecvBuffer can't CommitWrite more than WriteSpace!");
+    end_ += size;
+  }
+  const char* ReadPtr() {
+    return data_ + begin_;
+  }
+  Si32 Length() {
+    return end_ - begin_;
+  }
+  void Consume(Si32 size) {
+    Check(size <= Length(), "RecvBuffer can't Consume more than Length!");
+    begin_ += size;
+  }
+  void Clear() {
+    begin_ = 0;
+    end_ = 0;
+  }
+  void Rewind() {
+    if (begin_ == end_) {
+      begin_ = 0;
+      end_ = 0;
+    } else if (begin_) {
+      memmove(data_, data_ + begin_, size_t(end_ - begin_));
+      end_ -= begin_;
+      begin_ = 0;
+    }
+  }
+};
+
+constexpr Si32 kAvatarStateMsgSize = MsgWireSize<MsgAvatarState>();
+
+void EncodeAvatarState(const Avatar &a, char *out);
+MsgAvatarState LoadAvatarState(MsgView<MsgAvatarState> v);
+
+// Serialized MsgAvatarState (with header) for each avatar, encoded at most once per tick
+// no matter how many connections send it. Entries are dropped at the start of every
+// tick and when the avatar is reported as changed.
+class AvatarStateCache {
+  struct Entry {
+    Uii uii;
+    Ui32 epoch = 0;
+    char bytes[kAvatarStateMsgSize];
+  };
+  std::vector<Entry> entries_;
+  Ui32 epoch_ = 1;
+ public:
+  void BeginTick() {
+    ++epoch_;
+    if (epoch_ == 0) {
+      for (Entry &e : entries_) {
+        e.epoch = 0;
+      }
+      epoch_ = 1;
+    }
+  }
+
+  void Invalidate(Uii uii) {
+    if (uii.GetIdx() < entries_.size()) {
+      entries_[uii.GetIdx()].epoch = 0;
+    }
+  }
+
+  const char* Get(const Avatar &a) {
+    Ui32 idx = a.uii.GetIdx();
+    if (idx >= entries_.size()) {
+      entries_.resize(idx + 1);
+    }
+    Entry &e = entries_[idx];
+    if (e.epoch != epoch_ || e.uii != a.uii) {
+      EncodeAvatarState(a, e.bytes);
+      e.uii = a.uii;
+      e.epoch = epoch_;
+    }
+    return e.bytes;
+  }
+};
+
+// Compact avatar state (protocol version 2+).
+// Payload: varint uii, varint baseline distance, Ui8 field mask, then only the fields
+// present in the mask. Numeric fields are zigzag varint deltas against the baseline,
+// the state the client acknowledged `baseline distance` compact states ago
+// (0 means no baseline, deltas are then against MakeEmptyAvatarState(uii, base_tick),
+// where base_tick is the one of the kMsgTypeAvatarStateBatch or 0 outside of a batch).
+// Compact states are numbered implicitly, 1, 2, 3... in the order they are sent,
+// each record of a batch counts as one. Batches carry the number of their first record,
+// so a lost batch over UDP does not shift the numbering.
+enum CompactStateField {
+  kCompactStateUnitType = 1 << 0,
+  kCompactStateState = 1 << 1,
+  kCompactStateBeginTick = 1 << 2,
+  kCompactStateBeginPos = 1 << 3,
+  kCompactStateDuration = 1 << 4,
+  kCompactStateEndOffset = 1 << 5,
+  kCompactStateTarget = 1 << 6
+};
+
+constexpr Si32 kMaxCompactStateSize = 5 + 5 + 1 + 1 + 1 + 5 + 5 + 5 + 3 + 3 + 3 + 5;
+static_assert(kMaxCompactStateSize < 0x80, "Batch record size must be a one byte varint");
+constexpr Ui32 kCompactStateHistorySize = 8;
+// Compact states a connection remembers until they are acked, a power of two
+constexpr Ui32 kMaxUnackedCompactStates = 4096;
+static_assert((kMaxUnackedCompactStates & (kMaxUnackedCompactStates - 1)) == 0,
+  "kMaxUnackedCompactStates must be a power of two");
+
+inline Ui32 ZigZag(Si32 v) {
+  return (Ui32(v) << 1) ^ Ui32(v >> 31);
+}
+
+inline Si32 UnZigZag(Ui32 v) {
+  return Si32(v >> 1) ^ -Si32(v & 1);
+}
+
+inline char* WriteVarUi32(char *p, Ui32 v) {
+  while (v >= 0x80) {
+    *p++ = char(Ui8(v) | 0x80);
+    v >>= 7;
+  }
+  *p++ = char(v);
+  return p;
+}
+
+inline const char* ReadVarUi32(const char *p, const char *end, Ui32 *out_v) {
+  Ui32 v = 0;
+  for (Ui32 shift = 0; shift < 35 && p < end; shift += 7) {
+    Ui8 b = Ui8(*p++);
+    v |= Ui32(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *out_v = v;
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+MsgAvatarState MakeEmptyAvatarState(Uii uii, Ui32 base_tick);
+
+// Returns the payload size
+Si32 EncodeAvatarStateCompact(const MsgAvatarState &m, const MsgAvatarState &baseline,
+    Ui32 baseline_distance, char *out);
+
+// Reads the part of the payload needed to find the baseline.
+// Returns the position of the field mask or nullptr if the payload is malformed.
+const char* DecodeAvatarStateCompactHeader(const char *p, const char *end,
+    Uii *out_uii, Ui32 *out_baseline_distance);
+
+bool DecodeAvatarStateCompactFields(const char *p, const char *end,
+    const MsgAvatarState &baseline, MsgAvatarState *out);
+
+}  // namespace arctic
+
+#endif /* net_protocol_hpp */
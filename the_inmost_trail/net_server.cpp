@@ -0,0 +1,1245 @@
+#include "net_server.hpp"
+
+#include <cmath>
+#include "engine/log.h"
+
+namespace arctic {
+
+float g_replication_state_weight[kChStateCount] = {
+  1.f,   // kChStateIdle
+  4.f,   // kChStateWalkToPoint
+  4.f,   // kChStateWalkToItem
+  8.f,   // kChStateWalkToAttack
+  16.f,  // kChStatePlayAttack
+  8.f,   // kChStatePlayDying
+  2.f    // kChStateDead
+};
+
+bool Connection::EnterVisible(Uii avatar_uii) {
+  auto it = std::lower_bound(visible.begin(), visible.end(), avatar_uii,
+    [](const Uii &a, const Uii &b) { return a.value < b.value; });
+  if (it != visible.end() && *it == avatar_uii) {
+    return false;
+  }
+  visible.insert(it, avatar_uii);
+  queue.PushBack(avatar_uii);
+  return true;
+}
+
+bool Connection::LeaveVisible(Uii avatar_uii) {
+  auto it = std::lower_bound(visible.begin(), visible.end(), avatar_uii,
+    [](const Uii &a, const Uii &b) { return a.value < b.value; });
+  if (it == visible.end() || *it != avatar_uii) {
+    return false;
+  }
+  visible.erase(it);
+  leave_queue.PushBack(avatar_uii);
+  return true;
+}
+
+bool Connection::ClearVisible() {
+  for (Uii avatar_uii : visible) {
+    leave_queue.PushBack(avatar_uii);
+  }
+  bool is_changed = !visible.empty();
+  visible.clear();
+  return is_changed;
+}
+
+void Connection::Release() {
+  socket = ServerConnectionSocket();
+  queue = ReplicationScheduler();
+  visible = std::vector<Uii>();
+  leave_queue = UiiQueue();
+  pending_cmds = std::vector<PendingCmd>();
+  baselines = std::unordered_map<Ui32, AvatarBaseline>();
+  unacked_states = std::vector<SentAvatarState>();
+  channel.reset();
+  sent_snapshots = std::deque<SentSnapshot>();
+}
+
+void Connection::Reset() {
+  state = kConnStateInvalid;
+  incoming.Clear();
+  last_prepare_time = 0.0;
+  protocol_version = kProtocolVersionBase;
+  is_registration_response_pending = false;
+  registration_result = MsgRegistrationResponse::kResultSuccess;
+  is_avatar_pending = false;
+  is_pong_pending = false;
+  ping_c_time = 0.0;
+  ping_receive_time = 0.0;
+  cmd_seq = 0;
+  applied_cmd_seq = 0;
+  acked_cmd_seq = 0;
+  oldest_unacked_seq = 1;
+  next_compact_seq = 1;
+  uii = kInvalidUii;
+  idx = 0;
+  outgoing_used = 0;
+  outgoing_sent = 0;
+  is_awake = false;
+  is_read_drained = false;
+  is_write_blocked = false;
+  is_linked = false;
+  is_link_open = false;
+  is_packet_in_flight = false;
+  link_id = 0;
+  is_udp = false;
+  is_udp_open = false;
+  address = NetAddress();
+  outgoing_reliable_used = 0;
+}
+
+void Connection::Init(ServerConnectionSocket &&in_socket, Ui32 in_idx) {
+  socket = std::move(in_socket);
+  state = kConnStateJustConnected;
+  idx = in_idx;
+}
+
+void Connection::InitLinked(Ui32 in_link_id, Ui32 in_idx) {
+  state = kConnStateJustConnected;
+  idx = in_idx;
+  link_id = in_link_id;
+  is_linked = true;
+  is_link_open = true;
+}
+
+void Connection::InitUdp(const NetAddress &in_address, Ui32 in_idx) {
+  state = kConnStateJustConnected;
+  idx = in_idx;
+  address = in_address;
+  is_udp = true;
+  is_udp_open = true;
+  channel.reset(new NetChannel(NetTime()));
+  // Nothing to read from a socket of its own
+  is_read_drained = true;
+}
+
+void Connection::HandleMsg(MsgView<MsgRegistrationRequest> m) {
+  Ui32 requested_version = m.Get(&MsgRegistrationRequest::protocol_version);
+  // Over UDP the compact states must be numbered explicitly, as batches do
+  Ui32 min_version = (is_udp ? kProtocolVersionStateBatch : kProtocolVersionBase);
+  if (requested_version < min_version) {
+    registration_result = MsgRegistrationResponse::kResultProtocolVersionMismatch;
+  } else {
+    registration_result = MsgRegistrationResponse::kResultSuccess;
+    protocol_version = std::min(requested_version, kProtocolVersion);
+    state = kConnStateRegistered;
+    baselines.clear();
+    unacked_states.resize(kMaxUnackedCompactStates);
+    oldest_unacked_seq = 1;
+    next_compact_seq = 1;
+    is_avatar_pending = true;
+  }
+  is_registration_response_pending = true;
+}
+
+void Connection::SetAvatar(Uii avatar_uii) {
+  is_avatar_pending = false;
+  uii = avatar_uii;
+  if (avatar_uii == kInvalidUii) {
+    registration_result = MsgRegistrationResponse::kResultUnknownError;
+    state = kConnStateJustConnected;
+  }
+}
+
+void Connection::HandleMsg(MsgView<MsgPing> m) {
+  is_pong_pending = true;
+  ping_c_time = m.Get(&MsgPing::c_time);
+  ping_receive_time = NetTime();
+}
+
+void Connection::HandleMsg(MsgView<MsgPlayerCmdWalkToPoint> m) {
+  ++cmd_seq;
+  PendingCmd cmd;
+  cmd.type = kMsgTypePlayerCmdWalkToPoint;
+  cmd.pos = Vec2Si32(Si32(m.Get(&MsgPlayerCmdWalkToPoint::x)),
+    Si32(m.Get(&MsgPlayerCmdWalkToPoint::y)));
+  cmd.target_uii = kInvalidUii;
+  pending_cmds.push_back(cmd);
+}
+
+void Connection::HandleMsg(MsgView<MsgPlayerCmdInteractWithItem> m) {
+  ++cmd_seq;
+  PendingCmd cmd;
+  cmd.type = kMsgTypePlayerCmdInteractWithItem;
+  cmd.pos = Vec2Si32(0, 0);
+  cmd.target_uii.value = m.Get(&MsgPlayerCmdInteractWithItem::item_uii);
+  pending_cmds.push_back(cmd);
+}
+
+void Connection::HandleMsg(MsgView<MsgPlayerCmdAttack> m) {
+  ++cmd_seq;
+  PendingCmd cmd;
+  cmd.type = kMsgTypePlayerCmdAttack;
+  cmd.pos = Vec2Si32(0, 0);
+  cmd.target_uii.value = m.Get(&MsgPlayerCmdAttack::target_uii);
+  pending_cmds.push_back(cmd);
+}
+
+void Connection::HandleMsg(MsgView<MsgPlayerCmdBatch> batch) {
+  Ui32 seq = batch.Get(&MsgPlayerCmdBatch::first_seq);
+  Ui8 count = batch.Get(&MsgPlayerCmdBatch::count);
+  const char *p = batch.Data() + sizeof(MsgPlayerCmdBatch);
+  const char *end = batch.Data() + batch.Size();
+  for (Ui8 i = 0; i < count; ++i, ++seq) {
+    MsgFrame f;
+    if (!ReadMsgFrame(p, Si32(end - p), &f) || f.Size() > end - p || !IsPlayerCmdMsg(f.type)) {
+      HandleMsgError("PlayerCmdBatch is malformed!");
+      return;
+    }
+    Si32 distance = Si32(seq - cmd_seq);
+    if (distance > 1) {
+      // Never happens unless the client forgets commands before they are acked
+      HandleMsgError("PlayerCmdBatch skips commands!");
+      return;
+    }
+    if (distance == 1) {
+      // The command handler counts it in cmd_seq, the ones already seen are skipped
+      DispatchMessages(*this, p, f.Size());
+    }
+    p += f.Size();
+  }
+}
+
+void Connection::ApplyCmds(NetServerState *server) {
+  Avatar *own = server->avatars.TryGetItem(uii);
+  for (const PendingCmd &cmd : pending_cmds) {
+    if (!own) {
+      break;
+    }
+    if (cmd.type == kMsgTypePlayerCmdWalkToPoint) {
+      server->WalkAvatar(*own, cmd.pos);
+      continue;
+    }
+    // Items on the map are avatars so far, the avatar walks up to where the target is now
+    Avatar *target = server->avatars.TryGetItem(cmd.target_uii);
+    if (!target || target == own || !target->GetCell()) {
+      continue;
+    }
+    ChState state = (cmd.type == kMsgTypePlayerCmdAttack ?
+      kChStateWalkToAttack : kChStateWalkToItem);
+    server->WalkAvatar(*own, target->GetCellAt(server->tick), state, target->uii);
+  }
+  pending_cmds.clear();
+  applied_cmd_seq = cmd_seq;
+}
+
+void Connection::HandleMsgError(const char *message) {
+  *Log() << NetTime() << " " << message;
+}
+
+void Connection::HandleMsg(MsgView<MsgAvatarStateAck> m) {
+  if (is_udp || oldest_unacked_seq == next_compact_seq) {
+    return;
+  }
+  AckAvatarStates(oldest_unacked_seq, m.Get(&MsgAvatarStateAck::seq));
+}
+
+void Connection::AckAvatarStates(Ui32 first_seq, Ui32 last_seq) {
+  while (oldest_unacked_seq != next_compact_seq && Si32(oldest_unacked_seq - last_seq) <= 0) {
+    SentAvatarState &sent = unacked_states[oldest_unacked_seq & (kMaxUnackedCompactStates - 1)];
+    auto it = baselines.find(sent.state.uii.GetIdx());
+    if (it != baselines.end() && Si32(sent.seq - first_seq) >= 0) {
+      AvatarBaseline &b = it->second;
+      if (b.uii == sent.state.uii && Si32(sent.seq - b.first_seq) >= 0 &&
+          (!b.has_acked || Si32(sent.seq - b.acked_seq) > 0)) {
+        b.acked = sent.state;
+        b.has_acked = true;
+        b.acked_seq = sent.seq;
+        b.acked_send_count = sent.send_count;
+      }
+    } else if (it != baselines.end() && it->second.uii == sent.state.uii &&
+        it->second.send_count == sent.send_count && IsVisible(sent.state.uii)) {
+      // Lost and nothing newer was sent, avatars are only queued again when they change
+      queue.PushBack(sent.state.uii);
+    }
+    ++oldest_unacked_seq;
+  }
+}
+
+Si32 Connection::WriteAvatarStateRecord(const MsgAvatarState &m, Ui32 base_tick, char *out) {
+  Ui32 seq = next_compact_seq++;
+  AvatarBaseline &b = baselines[m.uii.GetIdx()];
+  if (b.uii != m.uii) {
+    b = AvatarBaseline();
+    b.uii = m.uii;
+    b.first_seq = seq;
+  }
+  // The client keeps kCompactStateHistorySize last states per avatar,
+  // the baseline must still be among them
+  Si32 size = 0;
+  if (b.has_acked && b.send_count - b.acked_send_count < kCompactStateHistorySize) {
+    size = EncodeAvatarStateCompact(m, b.acked, seq - b.acked_seq, out);
+  } else {
+    size = EncodeAvatarStateCompact(m, MakeEmptyAvatarState(m.uii, base_tick), 0, out);
+  }
+  b.send_count++;
+  if (seq - oldest_unacked_seq == kMaxUnackedCompactStates) {
+    ++oldest_unacked_seq;
+  }
+  SentAvatarState &sent = unacked_states[seq & (kMaxUnackedCompactStates - 1)];
+  sent.seq = seq;
+  sent.send_count = b.send_count;
+  sent.state = m;
+  return size;
+}
+
+Si32 Connection::WriteAvatarStateCompact(const MsgAvatarState &m, char *out) {
+  Si32 size = WriteAvatarStateRecord(m, 0, out + sizeof(MsgHeader));
+  WriteMsgHeader<MsgAvatarStateCompact>(out, size);
+  return Si32(sizeof(MsgHeader)) + size;
+}
+
+Si32 Connection::WriteAvatarStateBatch(NetServerState *server, char *out, Si32 space) {
+  constexpr Si32 kRecordMaxSize = 1 + kMaxCompactStateSize;
+  Si32 max_payload_size = std::min(space - kMsgExtendedHeaderSize, kMaxMsgPayloadSize);
+  char *payload = out + kMsgExtendedHeaderSize;
+  Si32 payload_size = Si32(sizeof(MsgAvatarStateBatch));
+  MsgAvatarStateBatch m;
+  m.base_tick = server->tick;
+  m.first_seq = next_compact_seq;
+  m.count = 0;
+  while (queue.Length() && payload_size + kRecordMaxSize <= max_payload_size &&
+      m.count < std::numeric_limits<Ui16>::max()) {
+    Uii avatar_uii = queue.PopHighest();
+    Avatar *a = server->avatars.TryGetItem(avatar_uii);
+    if (!a || !IsVisible(avatar_uii)) {
+      continue;
+    }
+    const char *encoded = server->avatar_state_cache.Get(*a);
+    MsgAvatarState state = LoadAvatarState(MsgView<MsgAvatarState>(encoded + sizeof(MsgHeader),
+      Si32(sizeof(MsgAvatarState))));
+    char *record = payload + payload_size;
+    Si32 record_size = WriteAvatarStateRecord(state, m.base_tick, record + 1);
+    record[0] = char(record_size);
+    payload_size += 1 + record_size;
+    m.count++;
+  }
+  if (!m.count) {
+    return 0;
+  }
+  StoreFieldsLe(payload, m);
+  WriteMsgHeaderExtended<MsgAvatarStateBatch>(out, payload_size);
+  return kMsgExtendedHeaderSize + payload_size;
+}
+
+void Connection::PrepareOutgoingData(NetServerState *server) {
+  constexpr Si32 kMaxSize = kConnOutgoingBufferSize - std::max(kAvatarStateMsgSize,
+    Si32(sizeof(MsgHeader)) + kMaxCompactStateSize);
+  if (is_registration_response_pending && !is_avatar_pending) {
+    MsgRegistrationResponse m;
+    m.protocol_version = protocol_version;
+    m.result = registration_result;
+    m.avatar_uii = uii.value;
+    outgoing_used += WriteMsg(outgoing + outgoing_used, m);
+    is_registration_response_pending = false;
+  }
+  if (is_pong_pending) {
+    // The time the server held the ping is then split evenly between both ways
+    MsgPong m;
+    m.c_time = ping_c_time;
+    m.s_time = server->GetServerTime((ping_receive_time + NetTime()) * 0.5);
+    outgoing_used += WriteMsg(outgoing + outgoing_used, m);
+    is_pong_pending = false;
+  }
+  if (acked_cmd_seq != applied_cmd_seq && protocol_version >= kProtocolVersionCmdAck) {
+    // Goes before the avatar states, so the client knows which commands they reflect
+    MsgPlayerCmdAck m;
+    m.cmd_seq = applied_cmd_seq;
+    outgoing_used += WriteMsg(outgoing + outgoing_used, m);
+  }
+  acked_cmd_seq = applied_cmd_seq;
+  while (outgoing_used < kMaxSize && leave_queue.Length()) {
+    Uii uii = leave_queue.PopFront();
+    if (IsVisible(uii)) {
+      // Came back before the leave event was sent
+      continue;
+    }
+    MsgAvatarLeave m;
+    m.uii = uii;
+    outgoing_used += WriteMsg(outgoing + outgoing_used, m);
+    // The client forgets its state history on leave, so must the baseline
+    auto it = baselines.find(uii.GetIdx());
+    if (it != baselines.end() && it->second.uii == uii) {
+      baselines.erase(it);
+    }
+  }
+  outgoing_reliable_used = outgoing_used;
+  if (queue.Length()) {
+    Avatar *own = server->avatars.TryGetItem(uii);
+    Vec2Si32 center(0, 0);
+    if (own && own->GetCell()) {
+      center = server->map.GetCellPos(own->GetCell());
+    }
+    double time = NetTime();
+    double dt = std::max(time - last_prepare_time, 0.001);
+    last_prepare_time = time;
+    queue.Accumulate(dt, [&](Uii avatar_uii) -> float {
+      Avatar *a = server->avatars.TryGetItem(avatar_uii);
+      if (!a) {
+        // Gets popped and dropped right away
+        return kReplicationMissingWeight;
+      }
+      if (a == own) {
+        return kReplicationOwnAvatarWeight;
+      }
+      float weight = g_replication_state_weight[a->state < kChStateCount ? a->state : kChStateIdle];
+      if (a->target_uii == uii) {
+        weight *= kReplicationTargetsMeMultiplier;
+      }
+      if (own && own->GetCell() && a->GetCell()) {
+        Vec2Si32 pos = server->map.GetCellPos(a->GetCell());
+        float dx = float(pos.x - center.x);
+        float dy = float(pos.y - center.y);
+        weight /= 1.f + std::sqrt(dx * dx + dy * dy);
+      }
+      return weight;
+    });
+  }
+  if (protocol_version >= kProtocolVersionStateBatch) {
+    constexpr Si32 kMinBatchSize = kMsgExtendedHeaderSize + Si32(sizeof(MsgAvatarStateBatch)) +
+      1 + kMaxCompactStateSize;
+    // Over UDP the snapshot must fit one datagram next to the reliable messages
+    Si32 limit = (is_udp ? std::min(outgoing_used + kUdpMaxUnreliableSize, kConnOutgoingBufferSize) :
+      kConnOutgoingBufferSize);
+    while (queue.Length() && limit - outgoing_used >= kMinBatchSize) {
+      outgoing_used += WriteAvatarStateBatch(server, outgoing + outgoing_used, limit - outgoing_used);
+    }
+    return;
+  }
+  while (outgoing_used < kMaxSize) {
+    if (queue.Length()) {
+      Uii uii = queue.PopHighest();
+      Avatar* a = server->avatars.TryGetItem(uii);
+      if (a && IsVisible(uii)) {
+        const char *encoded = server->avatar_state_cache.Get(*a);
+        if (protocol_version >= kProtocolVersionCompactState) {
+          MsgAvatarState m = LoadAvatarState(MsgView<MsgAvatarState>(
+            encoded + sizeof(MsgHeader), Si32(sizeof(MsgAvatarState))));
+          outgoing_used += WriteAvatarStateCompact(m, outgoing + outgoing_used);
+        } else {
+          memcpy(outgoing + outgoing_used, encoded, kAvatarStateMsgSize);
+          outgoing_used += kAvatarStateMsgSize;
+        }
+      }
+    } else {
+      break;
+    }
+  }
+}
+
+void Connection::HandleIncomingData() {
+  Si32 handled = HandleMessages(incoming.ReadPtr(), incoming.Length());
+  if (handled == kMsgStreamBroken) {
+    // Closed like a disconnect, UpdateReplication then removes the connection
+    *Log() << NetTime() << " Closing connections[" << idx << "], its stream is broken";
+    socket = ServerConnectionSocket();
+    handled = incoming.Length();
+  }
+  incoming.Consume(handled);
+  incoming.Rewind();
+}
+
+Si32 Connection::HandleMessages(const char *data, Si32 size) {
+  return DispatchMessages(*this, data, size);
+}
+
+void Connection::ReadIncoming() {
+  if (is_udp) {
+    // Datagrams are read by NetServerState::UpdateUdpInput
+    return;
+  }
+  // One Read takes as much as the socket has, then every complete message is handled
+  size_t read = 0;
+  size_t bytes_to_read = size_t(incoming.WriteSpace());
+  SocketResult res = socket.Read(incoming.WritePtr(), bytes_to_read, &read);
+  incoming.CommitWrite(Si32(read));
+  is_read_drained = (read < bytes_to_read);
+  if (res != kSocketOk) {
+    *Log() << NetTime() << " UpdateServer connections[" << idx << "] Read error: " << socket.GetLastError();
+    if (res == kSocketConnectionReset) {
+      // TODO: handle disconnection in a way that makes sense
+    }
+  } else if (read == 0) {
+    //*Log() << NetTime() << " UpdateServer g_connections[" << idx << "] read: 0";
+    // nothing to read
+  }
+  HandleIncomingData();
+}
+
+void Connection::WriteOutgoing(NetServerState *server) {
+  if (is_udp) {
+    SendDatagram(server);
+    return;
+  }
+  if (outgoing_used == 0) {
+    PrepareOutgoingData(server);
+  }
+  if (outgoing_sent < outgoing_used && socket.IsValid()) {
+    size_t written = 0;
+    SocketResult res = socket.Write(outgoing + outgoing_sent,
+      outgoing_used - outgoing_sent, &written);
+    if (res != kSocketOk) {
+      *Log() << NetTime() << " UpdateServer connections[" << idx << "] Write error: " << socket.GetLastError();
+    } else {
+      is_write_blocked = (written < size_t(outgoing_used - outgoing_sent));
+      outgoing_sent += written;
+      if (outgoing_sent == outgoing_used) {
+        outgoing_sent = 0;
+        outgoing_used = 0;
+      }
+    }
+  }
+}
+
+void Connection::SendOutgoing(NetServerState *server) {
+#ifdef NET_HAS_EPOLL
+  if (is_udp) {
+    SendDatagram(server);
+    return;
+  }
+  if (is_packet_in_flight || !is_link_open) {
+    return;
+  }
+  if (outgoing_used == 0) {
+    PrepareOutgoingData(server);
+  }
+  if (outgoing_used == 0) {
+    return;
+  }
+  NetPacket *packet = server->io_workers.AllocPacket();
+  packet->link_id = link_id;
+  packet->size = outgoing_used;
+  memcpy(packet->data, outgoing, size_t(outgoing_used));
+  outgoing_used = 0;
+  server->io_workers.Send(packet);
+  is_packet_in_flight = true;
+#endif
+}
+
+void Connection::ReceiveDatagram(const char *data, Si32 size) {
+  NetChannelInput input;
+  if (!is_udp_open || !channel->ReadPacket(data, size, NetTime(), &input)) {
+    return;
+  }
+  for (Ui16 packet_seq : channel->GetNewlyAcked()) {
+    OnSnapshotPacketAcked(packet_seq);
+  }
+  HandleMessages(input.reliable, input.reliable_size);
+  HandleMessages(input.unreliable, input.unreliable_size);
+}
+
+void Connection::SendDatagram(NetServerState *server) {
+#ifdef NET_HAS_EPOLL
+  if (!is_udp_open) {
+    return;
+  }
+  Ui32 first_seq = next_compact_seq;
+  PrepareOutgoingData(server);
+  channel->QueueReliable(outgoing, outgoing_reliable_used);
+  const char *unreliable = outgoing + outgoing_reliable_used;
+  Si32 unreliable_size = outgoing_used - outgoing_reliable_used;
+  outgoing_used = 0;
+  double time = NetTime();
+  if (!channel->IsSendDue(unreliable_size != 0, time)) {
+    return;
+  }
+  char packet[kUdpMaxPacketSize];
+  Si32 size = channel->WritePacket(unreliable, unreliable_size, time, packet);
+  if (next_compact_seq != first_seq) {
+    SentSnapshot sent;
+    sent.packet_seq = channel->GetLastSentSeq();
+    sent.first_seq = first_seq;
+    sent.end_seq = next_compact_seq;
+    sent_snapshots.push_back(sent);
+    if (sent_snapshots.size() > kUdpSentPacketHistory) {
+      sent_snapshots.pop_front();
+    }
+  }
+  server->SendDatagram(address, packet, size);
+#endif
+}
+
+void Connection::OnSnapshotPacketAcked(Ui16 packet_seq) {
+  while (sent_snapshots.size() && !IsSeqNewer(sent_snapshots.front().packet_seq, packet_seq)) {
+    SentSnapshot &sent = sent_snapshots.front();
+    if (sent.packet_seq == packet_seq) {
+      AckAvatarStates(sent.first_seq, sent.end_seq - 1);
+    }
+    sent_snapshots.pop_front();
+  }
+}
+
+NetServerState::NetServerState(Ui32 map_width, Ui32 map_height, Ui64 avatar_capacity)
+    : map(map_width, map_height) {
+  avatars.Prepare(avatar_capacity);
+  avatar_motion.Prepare(avatar_capacity);
+}
+
+void NetServerState::InitPoller() {
+#ifdef NET_HAS_EPOLL
+  if (!is_poller_enabled || poller.IsValid() || IsIoThreaded()) {
+    return;
+  }
+  if (!poller.Init(kPollerMaxEventsPerWait)) {
+    *Log() << "UpdateServer poller Init: " << poller.GetLastError() << ", falling back to updating every connection";
+    is_poller_enabled = false;
+    return;
+  }
+  for (Ui32 idx : connections.GetLive()) {
+    if (connections[idx].IsValid()) {
+      poller.Add(connections[idx].GetSocketHandle(), idx);
+      WakeConnection(idx);
+    }
+  }
+#endif
+}
+
+void NetServerState::InitIoWorkers() {
+#ifdef NET_HAS_EPOLL
+  if (io_worker_count == 0 || io_workers.IsRunning()) {
+    return;
+  }
+  if (!io_workers.Start(io_worker_count)) {
+    *Log() << "UpdateServer io_workers Start: " << io_workers.GetLastError() << ", doing I/O on the simulation thread";
+    io_worker_count = 0;
+    return;
+  }
+  if (is_reuseport_enabled && !io_workers.Listen(kNetworkServerAddress, kNetworkPort)) {
+    *Log() << "UpdateServer io_workers Listen: " << io_workers.GetLastError() << ", accepting on the simulation thread";
+    is_reuseport_enabled = false;
+  }
+#else
+  io_worker_count = 0;
+#endif
+}
+
+void NetServerState::InitSimWorkers() {
+  if (simulation_worker_count == 0 || sim_workers.IsRunning()) {
+    return;
+  }
+  sim_workers.Start(simulation_worker_count);
+}
+
+void NetServerState::HandleIoEvents() {
+#ifdef NET_HAS_EPOLL
+  NetIoEvent e;
+  while (io_workers.PopEvent(&e)) {
+    auto it = connection_by_link.find(e.link_id);
+    Connection *rec = (it == connection_by_link.end() ? nullptr : &connections[it->second]);
+    switch (e.type) {
+      case kNetIoEventAccepted: {
+        *Log() << NetTime() << " UpdateServer accepted a new connection";
+        Ui32 idx = connections.Add();
+        connections[idx].InitLinked(e.link_id, idx);
+        connection_by_link[e.link_id] = idx;
+        break;
+      }
+      case kNetIoEventMessages:
+        if (rec) {
+          rec->HandleMessages(e.packet->data, e.packet->size);
+        }
+        io_workers.Recycle(e.packet);
+        break;
+      case kNetIoEventSent:
+        if (rec) {
+          rec->OnPacketSent();
+        }
+        io_workers.FreePacket(e.packet);
+        break;
+      case kNetIoEventClosed:
+        if (rec) {
+          *Log() << NetTime() << " UpdateServer connections[" << it->second << "] closed";
+          rec->OnLinkClosed();
+        }
+        break;
+      default:
+        break;
+    }
+  }
+#endif
+}
+
+void NetServerState::RemoveConnection(Ui32 idx) {
+  Connection &rec = connections[idx];
+  // The avatar of the player goes with the connection. It is no longer controlled by the time
+  // it leaves the map, so only the connections that see it are updated.
+  Avatar *avatar = avatars.TryGetItem(rec.GetUii());
+  if (avatar && avatar->connection_handle == connections.GetHandle(idx)) {
+    Uii avatar_uii = avatar->uii;
+    avatar->connection_handle = kInvalidUii;
+    RemoveAvatarFromMap(*avatar);
+    avatars.FreeItem(avatar_uii);
+    avatar_motion.FreeItem(avatar_uii);
+  }
+  if (rec.IsAwake()) {
+    for (size_t n = 0; n < awake_connections.size(); ++n) {
+      if (awake_connections[n] == idx) {
+        awake_connections[n] = awake_connections.back();
+        awake_connections.pop_back();
+        break;
+      }
+    }
+  }
+#ifdef NET_HAS_EPOLL
+  if (rec.IsLinked()) {
+    connection_by_link.erase(rec.GetLinkId());
+  }
+  if (rec.IsUdp()) {
+    connection_by_address.erase(rec.GetAddress().GetKey());
+  }
+#endif
+  connections.Remove(idx);
+}
+
+Uii NetServerState::AddAvatar() {
+  Uii avatar_uii = avatars.AddItem();
+  if (avatar_uii == kInvalidUii) {
+    return avatar_uii;
+  }
+  Uii motion_uii = avatar_motion.AddItem();
+  Check(motion_uii == avatar_uii, "AddAvatar: avatar_motion is out of step with avatars.");
+  avatar_motion.TryGetItem(avatar_uii).Get<kAvatarColumnCellPos>() = kAvatarOffMap;
+  avatars.TryGetItem(avatar_uii)->AttachMotion(&avatar_motion);
+  return avatar_uii;
+}
+
+void NetServerState::SpawnAvatar(Ui32 idx) {
+  Connection &rec = connections[idx];
+  Avatar *own = avatars.TryGetItem(rec.GetUii());
+  if (own && own->connection_handle == connections.GetHandle(idx)) {
+    rec.SetAvatar(own->uii);
+    return;
+  }
+  Uii avatar_uii = AddAvatar();
+  if (avatar_uii == kInvalidUii) {
+    *Log() << NetTime() << " SpawnAvatar connections[" << idx << "]: avatar capacity reached";
+    rec.SetAvatar(kInvalidUii);
+    return;
+  }
+  Avatar &avatar = *avatars.TryGetItem(avatar_uii);
+  Vec2Si32 pos(Si32(map.Width() / 2), Si32(map.Height() / 2));
+  avatar.connection_handle = connections.GetHandle(idx);
+  avatar.unit_type = 0;
+  avatar.SetState(kChStateIdle);
+  avatar.SetMove(pos, pos, tick, tick);
+  avatar.SetTarget(kInvalidUii);
+  avatar.dirty_flags = 0;
+  // Before placing it, so that UpdateInterest fills the visible set of its connection
+  rec.SetAvatar(avatar_uii);
+  PlaceAvatar(avatar, Ui32(pos.x), Ui32(pos.y));
+  OnAvatarChanged(avatar);
+}
+
+void NetServerState::PlaceAvatar(Avatar &avatar, Ui32 x, Ui32 y) {
+  Check(x < map.Width() && y < map.Height(), "PlaceAvatar can't place an avatar outside of the map.");
+  MapCell *cell = &map.At(x, y);
+  if (avatar.GetCell() == cell) {
+    return;
+  }
+  MapCell *from = avatar.GetCell();
+  if (from) {
+    avatar.RemoveFromListGetNext();
+  }
+  avatar.AddToCell(cell, avatars);
+  auto motion = avatar_motion.TryGetItem(avatar.uii);
+  if (motion) {
+    motion.Get<kAvatarColumnCellPos>() = Vec2Si32(Si32(x), Si32(y));
+  }
+  UpdateInterest(avatar, from, cell);
+}
+
+void NetServerState::WalkAvatar(Avatar &avatar, Vec2Si32 target, ChState state,
+    Uii target_uii) {
+  target.x = std::max(0, std::min(target.x, Si32(map.Width()) - 1));
+  target.y = std::max(0, std::min(target.y, Si32(map.Height()) - 1));
+  Vec2Si32 pos = avatar.GetCellAt(tick);
+  if (avatar.GetCell()) {
+    PlaceAvatar(avatar, Ui32(pos.x), Ui32(pos.y));
+  }
+  Ui8 dirty_flags = avatar.SetMove(pos, target, tick,
+    tick + GetWalkDurationTicks(pos, target, tick_duration));
+  dirty_flags |= avatar.SetState(state);
+  dirty_flags |= avatar.SetTarget(target_uii);
+  OnAvatarChanged(avatar, dirty_flags);
+}
+
+void NetServerState::RemoveAvatarFromMap(Avatar &avatar) {
+  MapCell *from = avatar.GetCell();
+  if (from) {
+    avatar.RemoveFromListGetNext();
+    avatar.SetCell(nullptr);
+    auto motion = avatar_motion.TryGetItem(avatar.uii);
+    if (motion) {
+      motion.Get<kAvatarColumnCellPos>() = kAvatarOffMap;
+    }
+    UpdateInterest(avatar, from, nullptr);
+  }
+}
+
+void NetServerState::CheckAvatarMotion() {
+  for (Ui64 chunk_idx = 0; chunk_idx < avatars.LiveChunkCount(kAvatarPassChunkSize); ++chunk_idx) {
+    for (Ui32 idx : avatars.LiveChunk(chunk_idx, kAvatarPassChunkSize)) {
+      Avatar &a = avatars[idx];
+      auto motion = avatar_motion.TryGetItem(a.uii);
+      Check(bool(motion), "CheckAvatarMotion: the avatar has no avatar_motion.");
+      Vec2Si32 cell_pos = (a.GetCell() ? map.GetCellPos(a.GetCell()) : kAvatarOffMap);
+      Check(motion.Get<kAvatarColumnState>() == Ui8(a.state) &&
+        motion.Get<kAvatarColumnBeginPos>() == a.begin_pos &&
+        motion.Get<kAvatarColumnEndPos>() == a.end_pos &&
+        motion.Get<kAvatarColumnBeginTick>() == a.begin_tick &&
+        motion.Get<kAvatarColumnEndTick>() == a.end_tick &&
+        motion.Get<kAvatarColumnCellPos>() == cell_pos,
+        "CheckAvatarMotion: avatar_motion is stale, the avatar was changed without its setters.");
+    }
+  }
+}
+
+void NetServerState::UpdateMotion() {
+  Check(avatar_motion.Size() == avatars.Size(), "UpdateMotion: avatars must be added with AddAvatar.");
+#ifndef NDEBUG
+  CheckAvatarMotion();
+#endif
+  const Ui8 *state = avatar_motion.Column<kAvatarColumnState>();
+  const Vec2Si32 *begin_pos = avatar_motion.Column<kAvatarColumnBeginPos>();
+  const Vec2Si32 *end_pos = avatar_motion.Column<kAvatarColumnEndPos>();
+  const Ui32 *begin_tick = avatar_motion.Column<kAvatarColumnBeginTick>();
+  const Ui32 *end_tick = avatar_motion.Column<kAvatarColumnEndTick>();
+  const Vec2Si32 *cell_pos = avatar_motion.Column<kAvatarColumnCellPos>();
+  Ui32 chunk_count = Ui32(avatars.LiveChunkCount(kAvatarPassChunkSize));
+  if (moving_avatars.size() < chunk_count) {
+    moving_avatars.resize(chunk_count);
+  }
+  auto find_moving = [&](Ui32 chunk_idx) {
+    std::vector<Ui32> &moving = moving_avatars[chunk_idx];
+    moving.clear();
+    for (Ui32 idx : avatars.LiveChunk(chunk_idx, kAvatarPassChunkSize)) {
+      bool is_walking = (state[idx] == kChStateWalkToPoint || state[idx] == kChStateWalkToItem ||
+        state[idx] == kChStateWalkToAttack);
+      if (!is_walking || cell_pos[idx] == kAvatarOffMap) {
+        continue;
+      }
+      Vec2Si32 pos = GetWalkCellAt(begin_pos[idx], end_pos[idx], begin_tick[idx], end_tick[idx],
+        tick);
+      bool is_arrived = (state[idx] == kChStateWalkToPoint && Si32(tick - end_tick[idx]) >= 0);
+      if (pos != cell_pos[idx] || is_arrived) {
+        moving.push_back(idx);
+      }
+    }
+  };
+  sim_workers.ParallelFor(chunk_count, find_moving);
+  // Moving avatars changes the map, the interest sets and the columns,
+  // so it is done on this thread once the pass is over
+  for (Ui32 chunk_idx = 0; chunk_idx < chunk_count; ++chunk_idx) {
+    for (Ui32 idx : moving_avatars[chunk_idx]) {
+      Avatar &avatar = avatars[idx];
+      Vec2Si32 pos = avatar.GetCellAt(tick);
+      PlaceAvatar(avatar, Ui32(pos.x), Ui32(pos.y));
+      if (avatar.state == kChStateWalkToPoint && Si32(tick - avatar.end_tick) >= 0) {
+        Ui8 dirty_flags = avatar.SetMove(avatar.end_pos, avatar.end_pos, avatar.end_tick,
+          avatar.end_tick);
+        dirty_flags |= avatar.SetState(kChStateIdle);
+        OnAvatarChanged(avatar, dirty_flags);
+      }
+    }
+  }
+}
+
+void NetServerState::UpdateInterest(Avatar &avatar, MapCell *from, MapCell *to) {
+  Vec2Si32 from_pos = (from ? map.GetCellPos(from) : Vec2Si32(0, 0));
+  Vec2Si32 to_pos = (to ? map.GetCellPos(to) : Vec2Si32(0, 0));
+
+  Ui32 controller_idx = FindController(avatar);
+  if (controller_idx != kInvalidUii.GetIdx()) {
+    Connection &rec = connections[controller_idx];
+    bool is_changed = false;
+    if (!to) {
+      is_changed = rec.ClearVisible();
+    } else {
+      ForEachCellWithinInterest(to_pos, [&](Vec2Si32 pos, MapCell &cell) {
+        if (!from || !IsWithinInterest(pos, from_pos)) {
+          ForEachAvatarInCell(cell, [&](Avatar &a) {
+            is_changed |= rec.EnterVisible(a.uii);
+          });
+        }
+      });
+      if (from) {
+        ForEachCellWithinInterest(from_pos, [&](Vec2Si32 pos, MapCell &cell) {
+          if (!IsWithinInterest(pos, to_pos)) {
+            ForEachAvatarInCell(cell, [&](Avatar &a) {
+              is_changed |= rec.LeaveVisible(a.uii);
+            });
+          }
+        });
+      }
+    }
+    if (is_changed && IsPollerActive()) {
+      WakeConnection(controller_idx);
+    }
+  }
+
+  auto update_viewer = [&](Avatar &viewer, Vec2Si32 viewer_pos) {
+    if (&viewer == &avatar) {
+      return;
+    }
+    Ui32 idx = FindController(viewer);
+    if (idx == kInvalidUii.GetIdx()) {
+      return;
+    }
+    Connection &rec = connections[idx];
+    bool is_changed = (to && IsWithinInterest(viewer_pos, to_pos) ?
+      rec.EnterVisible(avatar.uii) : rec.LeaveVisible(avatar.uii));
+    if (is_changed && IsPollerActive()) {
+      WakeConnection(idx);
+    }
+  };
+  if (to) {
+    ForEachCellWithinInterest(to_pos, [&](Vec2Si32 pos, MapCell &cell) {
+      ForEachAvatarInCell(cell, [&](Avatar &viewer) {
+        update_viewer(viewer, pos);
+      });
+    });
+  }
+  if (from) {
+    ForEachCellWithinInterest(from_pos, [&](Vec2Si32 pos, MapCell &cell) {
+      if (!to || !IsWithinInterest(pos, to_pos)) {
+        ForEachAvatarInCell(cell, [&](Avatar &viewer) {
+          update_viewer(viewer, pos);
+        });
+      }
+    });
+  }
+}
+
+void NetServerState::QueueChangedAvatars() {
+  for (Uii changed_uii : changed_avatars) {
+    // A freed avatar may have been reused since, whatever is at the idx now is what is dirty
+    Avatar &a = avatars[changed_uii.GetIdx()];
+    if (!a.dirty_flags) {
+      continue;
+    }
+    a.dirty_flags = 0;
+    if (!a.GetCell()) {
+      // Nobody sees an avatar that is not on the map
+      continue;
+    }
+    // Interest is symmetric: the connections that see the avatar are the ones
+    // with their own avatar within interest_radius of it
+    ForEachCellWithinInterest(map.GetCellPos(a.GetCell()), [&](Vec2Si32, MapCell &cell) {
+      ForEachAvatarInCell(cell, [&](Avatar &viewer) {
+        Ui32 idx = FindController(viewer);
+        if (idx != kInvalidUii.GetIdx() && connections[idx].IsVisible(a.uii)) {
+          connections[idx].QueueAvatar(a.uii);
+          if (IsPollerActive()) {
+            WakeConnection(idx);
+          }
+        }
+      });
+    });
+  }
+  changed_avatars.clear();
+}
+
+void NetServerState::UpdateServer() {
+  UpdateNetworkInput();
+  UpdateSimulation(tick + 1);
+  UpdateReplication();
+}
+
+void NetServerState::StartListener() {
+  *Log() << NetTime() << " UpdateServer listener_socket is invalid, starting a new one";
+  listener_socket = ServerListenerSocket(AddressFamily::kIpV4, SocketProtocol::kTcp);
+  if (!listener_socket.IsValid()) {
+    *Log() << "UpdateServer ListenerSocket: " << listener_socket.GetLastError();
+    return;
+  }
+  SocketResult res = listener_socket.SetSoLinger(false, 0);
+  if (res != kSocketOk) {
+    *Log() << "UpdateServer SetSoLinger: " << listener_socket.GetLastError();
+    listener_socket = ServerListenerSocket();
+    return;
+  }
+  res = listener_socket.Bind(kNetworkServerAddress, kNetworkPort);
+  if (res != kSocketOk) {
+    *Log() << "UpdateServer Bind: " << listener_socket.GetLastError();
+    listener_socket = ServerListenerSocket();
+    return;
+  }
+  res = listener_socket.SetSoNonblocking(true);
+  if (res != kSocketOk) {
+    *Log() << "UpdateServer SetSoNonblocking: " << listener_socket.GetLastError();
+    listener_socket = ServerListenerSocket();
+    return;
+  }
+  InitPoller();
+#ifdef NET_HAS_EPOLL
+  if (IsPollerActive()) {
+    poller.Add(listener_socket.GetNativeHandle(), kPollerListenerTag);
+  }
+#endif
+  is_listener_ready = true;
+}
+
+void NetServerState::UpdateNetworkInput() {
+  avatar_state_cache.BeginTick();
+  if (!listener_socket.IsValid() && !IsAcceptingOnIoWorkers()) {
+    // The workers must be listening before anything binds the port without SO_REUSEPORT
+    InitIoWorkers();
+    if (!IsAcceptingOnIoWorkers()) {
+      StartListener();
+      if (!listener_socket.IsValid()) {
+        return;
+      }
+    }
+  }
+
+  if (IsIoThreaded()) {
+    if (!IsAcceptingOnIoWorkers()) {
+      AcceptConnections();
+    }
+    HandleIoEvents();
+  } else if (IsPollerActive()) {
+#ifdef NET_HAS_EPOLL
+    Si32 event_count = poller.Wait(0.0);
+    for (Si32 event_idx = 0; event_idx < event_count; ++event_idx) {
+      Ui32 tag = poller.GetEventTag(event_idx);
+      if (tag == kPollerListenerTag) {
+        is_listener_ready = true;
+      } else if (connections.IsLive(tag)) {
+        connections[tag].OnReadiness(poller.IsEventReadable(event_idx),
+          poller.IsEventWritable(event_idx));
+        WakeConnection(tag);
+      }
+    }
+#endif
+    if (is_listener_ready) {
+      AcceptConnections();
+    }
+    // Idle connections are not touched at all
+    for (Ui32 idx : awake_connections) {
+      if (connections[idx].IsValid()) {
+        connections[idx].ReadIncoming();
+      }
+    }
+  } else {
+    AcceptConnections();
+    for (Ui32 idx : connections.GetLive()) {
+      if (connections[idx].IsValid()) {
+        connections[idx].ReadIncoming();
+      }
+    }
+  }
+  UpdateUdpInput();
+}
+
+void NetServerState::UpdateUdpInput() {
+#ifdef NET_HAS_EPOLL
+  if (!is_udp_enabled) {
+    return;
+  }
+  if (!udp_socket.IsValid()) {
+    if (udp_socket.Open() != kSocketOk ||
+        udp_socket.Bind(kNetworkServerAddress, kNetworkPort) != kSocketOk) {
+      *Log() << "UpdateServer udp_socket: " << udp_socket.GetLastError();
+      udp_socket.Close();
+      return;
+    }
+  }
+  char packet[kUdpMaxPacketSize];
+  // New peers are limited to accept_budget per tick like TCP connections,
+  // so a flood of spoofed sources can't allocate without bound
+  Ui32 new_peer_count = 0;
+  for (Ui32 i = 0; i < kUdpMaxDatagramsPerUpdate; ++i) {
+    size_t size = 0;
+    NetAddress from;
+    SocketResult res = udp_socket.ReceiveFrom(packet, sizeof(packet), &size, &from);
+    if (res != kSocketOk) {
+      *Log() << NetTime() << " UpdateServer udp_socket ReceiveFrom: " << udp_socket.GetLastError();
+      break;
+    }
+    if (size == 0) {
+      break;
+    }
+    Ui32 idx = 0;
+    auto it = connection_by_address.find(from.GetKey());
+    if (it != connection_by_address.end()) {
+      idx = it->second;
+    } else {
+      // The peers over budget send their opening packet again, it is resent until acked
+      if (new_peer_count >= accept_budget || !IsUdpOpeningPacket(packet, Si32(size))) {
+        continue;
+      }
+      ++new_peer_count;
+      *Log() << NetTime() << " UpdateServer new UDP connection";
+      idx = connections.Add();
+      connections[idx].InitUdp(from, idx);
+      connection_by_address[from.GetKey()] = idx;
+    }
+    connections[idx].ReceiveDatagram(packet, Si32(size));
+    if (IsPollerActive()) {
+      WakeConnection(idx);
+    }
+  }
+
+  double time = NetTime();
+  if (time >= next_udp_timeout_check_time) {
+    next_udp_timeout_check_time = time + 1.0;
+    for (auto &entry : connection_by_address) {
+      if (connections[entry.second].IsUdpTimedOut(time)) {
+        *Log() << NetTime() << " UpdateServer UDP connection timed out";
+        // Removed along with the other invalid connections in UpdateReplication
+        connections[entry.second].CloseUdp();
+        if (IsPollerActive()) {
+          WakeConnection(entry.second);
+        }
+      }
+    }
+  }
+#endif
+}
+
+void NetServerState::SendDatagram(const NetAddress &address, const char *data, Si32 size) {
+#ifdef NET_HAS_EPOLL
+  SocketResult res = udp_conditioner.Send(udp_socket, data, size, address);
+  if (res != kSocketOk) {
+    *Log() << NetTime() << " UpdateServer udp_socket SendTo: " << udp_socket.GetLastError();
+  }
+#endif
+}
+
+void NetServerState::UpdateSimulation(Ui32 in_tick) {
+  InitSimWorkers();
+  tick = in_tick;
+  // The server clock runs at the rate of the local one and only follows the tick
+  // schedule on average, the jitter of when ticks actually start does not reach clients
+  double offset = double(tick) * tick_duration - NetTime();
+  if (!is_server_clock_started || std::abs(offset - server_time_offset) > tick_duration) {
+    // Started, or the schedule jumped as late ticks were dropped
+    server_time_offset = offset;
+    is_server_clock_started = true;
+  } else {
+    server_time_offset += (offset - server_time_offset) * kServerClockSmoothing;
+  }
+  for (Ui32 idx : connections.GetLive()) {
+    Connection &rec = connections[idx];
+    if (!rec.IsAvatarPending() && !rec.HasCmds()) {
+      continue;
+    }
+    if (rec.IsAvatarPending()) {
+      SpawnAvatar(idx);
+    }
+    if (rec.HasCmds()) {
+      rec.ApplyCmds(this);
+    }
+    if (IsPollerActive()) {
+      // To send the registration response or the ack
+      WakeConnection(idx);
+    }
+  }
+  UpdateMotion();
+}
+
+void NetServerState::UpdateReplication() {
+  QueueChangedAvatars();
+  if (IsIoThreaded()) {
+    const std::vector<Ui32> &live = connections.GetLive();
+    size_t n = 0;
+    while (n < live.size()) {
+      Ui32 idx = live[n];
+      Connection &rec = connections[idx];
+      if (rec.IsValid()) {
+        rec.SendOutgoing(this);
+        ++n;
+      } else {
+        // The last live connection takes its place
+        RemoveConnection(idx);
+      }
+    }
+#ifdef NET_HAS_EPOLL
+    io_workers.Flush();
+#endif
+  } else if (IsPollerActive()) {
+    // The awake connections stay awake until they have drained their input
+    // and flushed their output
+    size_t n = 0;
+    while (n < awake_connections.size()) {
+      Ui32 idx = awake_connections[n];
+      Connection &rec = connections[idx];
+      if (rec.IsValid()) {
+        rec.WriteOutgoing(this);
+      }
+      if (!rec.IsValid()) {
+        RemoveConnection(idx);
+      } else if (rec.HasPendingWork()) {
+        ++n;
+      } else {
+        rec.SetAwake(false);
+        awake_connections[n] = awake_connections.back();
+        awake_connections.pop_back();
+      }
+    }
+  } else {
+    const std::vector<Ui32> &live = connections.GetLive();
+    size_t n = 0;
+    while (n < live.size()) {
+      Ui32 idx = live[n];
+      Connection &rec = connections[idx];
+      if (rec.IsValid()) {
+        rec.WriteOutgoing(this);
+      }
+      if (rec.IsValid()) {
+        ++n;
+      } else {
+        RemoveConnection(idx);
+      }
+    }
+  }
+}
+
+void NetServerState::AcceptConnections() {
+  // Drain the backlog, up to accept_budget connections per tick so that a login storm
+  // does not stall the tick. The listener stays ready until Accept runs out of connections.
+  bool is_attached = false;
+  for (Ui32 i = 0; i < accept_budget; ++i) {
+    ServerConnectionSocket socket = listener_socket.Accept();
+    if (!socket.IsValid()) {
+      //*Log() << NetTime() << " UpdateServer no new connections";
+      is_listener_ready = false;
+      break;
+    }
+    *Log() << NetTime() << " UpdateServer accepted a new connection";
+
+    SocketResult res = socket.SetSoNonblocking(true);
+    if (res != kSocketOk) {
+      *Log() << "UpdateServer SetSoNonblocking error: " << socket.GetLastError();
+      continue;
+    }
+    Ui32 idx = connections.Add();
+    Connection &rec = connections[idx];
+#ifdef NET_HAS_EPOLL
+    if (IsIoThreaded()) {
+      Ui32 link_id = io_workers.Attach(std::move(socket));
+      rec.InitLinked(link_id, idx);
+      connection_by_link[link_id] = idx;
+      is_attached = true;
+    } else {
+      rec.Init(std::move(socket), idx);
+      if (IsPollerActive()) {
+        poller.Add(rec.GetSocketHandle(), idx);
+        WakeConnection(idx);
+      }
+    }
+#else
+    rec.Init(std::move(socket), idx);
+#endif
+  }
+#ifdef NET_HAS_EPOLL
+  if (is_attached) {
+    io_workers.Flush();
+  }
+#endif
+}
+
+}  // namespace arctic
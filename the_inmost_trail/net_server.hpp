@@ -0,0 +1,565 @@
+#ifndef net_server_hpp
+#define net_server_hpp
+
+#include <deque>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "engine/arctic_types.h"
+#include "world.hpp"
+#include "net_protocol.hpp"
+#include "net_channel.hpp"
+#include "net_socket.hpp"
+#include "net_poller.hpp"
+#include "net_io_workers.hpp"
+#include "sim_workers.hpp"
+
+namespace arctic {
+
+// How fast an avatar in each state builds up replication priority
+extern float g_replication_state_weight[kChStateCount];
+constexpr float kReplicationOwnAvatarWeight = 64.f;
+constexpr float kReplicationTargetsMeMultiplier = 4.f;
+constexpr float kReplicationMissingWeight = 1000000.f;
+
+class NetServerState;
+
+class Connection {
+  ServerConnectionSocket socket;
+  ConnState state = kConnStateInvalid;
+  RecvBuffer incoming;
+  ReplicationScheduler queue;
+  double last_prepare_time = 0.0;
+  // Avatars within the interest radius, sorted by Uii value
+  std::vector<Uii> visible;
+  UiiQueue leave_queue;
+  Ui32 protocol_version = kProtocolVersionBase;
+  bool is_registration_response_pending = false;
+  Ui32 registration_result = MsgRegistrationResponse::kResultSuccess;
+  // Set on registration until NetServerState::SpawnAvatar gives the connection its avatar,
+  // the registration response waits for it
+  bool is_avatar_pending = false;
+  // Only the last ping is answered, stamped halfway between its arrival and the reply
+  bool is_pong_pending = false;
+  double ping_c_time = 0.0;
+  double ping_receive_time = 0.0;
+  // Player commands received, applied and acknowledged, counted as the client numbers them
+  Ui32 cmd_seq = 0;
+  Ui32 applied_cmd_seq = 0;
+  Ui32 acked_cmd_seq = 0;
+  // Player commands received since the last ApplyCmds, in the order they came in
+  struct PendingCmd {
+    MsgType type;
+    Vec2Si32 pos;
+    Uii target_uii;
+  };
+  std::vector<PendingCmd> pending_cmds;
+  // Compact state delta baselines, by avatar idx
+  struct AvatarBaseline {
+    Uii uii;
+    MsgAvatarState acked;
+    bool has_acked = false;
+    Ui32 acked_seq = 0;
+    Ui32 acked_send_count = 0;
+    Ui32 send_count = 0;
+    Ui32 first_seq = 0;
+  };
+  struct SentAvatarState {
+    Ui32 seq;
+    Ui32 send_count;
+    MsgAvatarState state;
+  };
+  std::unordered_map<Ui32, AvatarBaseline> baselines;
+  // Ring of the compact states sent and not acked yet, by seq, from oldest_unacked_seq
+  // to next_compact_seq. Allocated on registration, once full the oldest are forgotten.
+  std::vector<SentAvatarState> unacked_states;
+  Ui32 oldest_unacked_seq = 1;
+  Ui32 next_compact_seq = 1;
+  Uii uii = kInvalidUii;
+  Ui32 idx = 0;
+  char outgoing[kConnOutgoingBufferSize];
+  Si32 outgoing_used = 0;
+  Si32 outgoing_sent = 0;
+  // Readiness tracking for the edge-triggered poller
+  bool is_awake = false;
+  bool is_read_drained = false;
+  bool is_write_blocked = false;
+  // Set when the socket is owned by an I/O worker and known to it as link_id
+  bool is_linked = false;
+  bool is_link_open = false;
+  bool is_packet_in_flight = false;
+  Ui32 link_id = 0;
+  // Set for a connection over UDP, its datagrams go through NetServerState::udp_socket
+  bool is_udp = false;
+  bool is_udp_open = false;
+  std::unique_ptr<NetChannel> channel;
+  NetAddress address;
+  // outgoing holds reliable messages up to here, the rest is unreliable
+  Si32 outgoing_reliable_used = 0;
+  // Compact states each UDP packet carried, acked along with the packet
+  struct SentSnapshot {
+    Ui16 packet_seq;
+    Ui32 first_seq;
+    Ui32 end_seq;
+  };
+  std::deque<SentSnapshot> sent_snapshots;
+
+ public:
+  Uii GetUii() {
+    return uii;
+  }
+#ifdef NET_HAS_EPOLL
+  int GetSocketHandle() {
+    return socket.GetNativeHandle();
+  }
+#endif
+  bool IsAwake() {
+    return is_awake;
+  }
+  void SetAwake(bool in_is_awake) {
+    is_awake = in_is_awake;
+  }
+  void OnReadiness(bool is_readable, bool is_writable) {
+    if (is_readable) {
+      is_read_drained = false;
+    }
+    if (is_writable) {
+      is_write_blocked = false;
+    }
+  }
+  // True while the socket may still have unread input or there is output that can be written now
+  bool HasPendingWork() {
+    if (!is_read_drained) {
+      return true;
+    }
+    if (is_write_blocked) {
+      return false;
+    }
+    return outgoing_used != 0 || queue.Length() != 0 || leave_queue.Length() != 0 ||
+      is_registration_response_pending || is_pong_pending || acked_cmd_seq != applied_cmd_seq ||
+      (is_udp_open && channel->HasUnackedReliable());
+  }
+
+  bool IsAvatarPending() {
+    return is_avatar_pending;
+  }
+  // Gives the registered connection its avatar, kInvalidUii if it can't have one
+  void SetAvatar(Uii avatar_uii);
+
+  bool HasCmds() {
+    return cmd_seq != applied_cmd_seq;
+  }
+  // Simulation phase of the tick: applies the player commands received since the last one
+  void ApplyCmds(NetServerState *server);
+
+  // Queues the avatar state to be sent, the avatar must be visible
+  void QueueAvatar(Uii avatar_uii) {
+    queue.PushBack(avatar_uii);
+  }
+
+  bool IsVisible(Uii avatar_uii) {
+    return std::binary_search(visible.begin(), visible.end(), avatar_uii,
+      [](const Uii &a, const Uii &b) { return a.value < b.value; });
+  }
+
+  // Adds the avatar to the visible set and queues its state,
+  // returns false if it was visible already
+  bool EnterVisible(Uii avatar_uii);
+  // Removes the avatar from the visible set and queues a leave event,
+  // returns false if it was not visible
+  bool LeaveVisible(Uii avatar_uii);
+  // Leaves every visible avatar, returns false if there was none
+  bool ClearVisible();
+
+  // Frees everything the connection holds on the heap and closes its socket,
+  // so that a removed connection costs no more than its slot
+  void Release();
+  // Puts a released connection back in its initial state, only the scalar fields
+  // are written as the containers are empty already
+  void Reset();
+
+  void Init(ServerConnectionSocket &&in_socket, Ui32 in_idx);
+  void InitLinked(Ui32 in_link_id, Ui32 in_idx);
+
+  bool IsLinked() {
+    return is_linked;
+  }
+  Ui32 GetLinkId() {
+    return link_id;
+  }
+  void OnLinkClosed() {
+    is_link_open = false;
+  }
+  void OnPacketSent() {
+    is_packet_in_flight = false;
+  }
+
+  void InitUdp(const NetAddress &in_address, Ui32 in_idx);
+  bool IsUdp() {
+    return is_udp;
+  }
+  const NetAddress& GetAddress() {
+    return address;
+  }
+  bool IsUdpTimedOut(double time) {
+    return is_udp_open && channel->IsTimedOut(time);
+  }
+  void CloseUdp() {
+    is_udp_open = false;
+  }
+  // Network input of a UDP connection, one datagram at a time
+  void ReceiveDatagram(const char *data, Si32 size);
+  // Replication of a UDP connection: sends one datagram if there is anything to send
+  void SendDatagram(NetServerState *server);
+  // Compact states first_seq to last_seq have reached the client and may be used as baselines,
+  // the older unacked ones are lost
+  void AckAvatarStates(Ui32 first_seq, Ui32 last_seq);
+  void OnSnapshotPacketAcked(Ui16 packet_seq);
+
+  // Called by DispatchMessages, m views the message in place in the receive buffer
+  void HandleMsg(MsgView<MsgRegistrationRequest> m);
+  void HandleMsg(MsgView<MsgPing> m);
+  void HandleMsg(MsgView<MsgPlayerCmdWalkToPoint> m);
+  void HandleMsg(MsgView<MsgPlayerCmdInteractWithItem> m);
+  void HandleMsg(MsgView<MsgPlayerCmdAttack> m);
+  // Applies the commands that follow the last one received, in order, and skips the rest
+  void HandleMsg(MsgView<MsgPlayerCmdBatch> batch);
+  // Everything up to and including seq has reached the client and may be used as a baseline.
+  // Ignored over UDP, where the packet acks tell exactly what has reached the client.
+  void HandleMsg(MsgView<MsgAvatarStateAck> m);
+  void HandleMsgError(const char *message);
+
+  // Writes the compact state payload delta-encoded against the client's acked baseline,
+  // returns the number of bytes written
+  Si32 WriteAvatarStateRecord(const MsgAvatarState &m, Ui32 base_tick, char *out);
+  // Same with a kMsgTypeAvatarStateCompact header
+  Si32 WriteAvatarStateCompact(const MsgAvatarState &m, char *out);
+  // Packs as many queued avatars as fit in space bytes into one kMsgTypeAvatarStateBatch,
+  // returns the number of bytes written, 0 if there was nothing to send
+  Si32 WriteAvatarStateBatch(NetServerState *server, char *out, Si32 space);
+
+  void PrepareOutgoingData(NetServerState *server);
+  void HandleIncomingData();
+  // Handles every whole message in data, returns the number of bytes handled
+  // or kMsgStreamBroken
+  Si32 HandleMessages(const char *data, Si32 size);
+  // Network input phase of the tick: reads the socket and handles every complete message
+  void ReadIncoming();
+  // Replication phase of the tick: fills the outgoing buffer if it is empty and writes it
+  void WriteOutgoing(NetServerState *server);
+  // Same for a linked connection: hands the outgoing buffer to the I/O worker
+  // unless the previous one is still being written
+  void SendOutgoing(NetServerState *server);
+
+  bool IsValid() {
+    return socket.IsValid() || is_link_open || is_udp_open;
+  }
+};
+
+// Connections in slots that never move, addressed by slot idx inside NetServerState and
+// by generational handles (the same idea as UniqueItemVector and Uii) from outside:
+// the handle of a removed connection never resolves to the next one in its slot.
+// Remove is O(1) and moves no Connection, live connections are listed densely.
+class ConnectionPool {
+  std::deque<Connection> slots_;
+  std::vector<Ui32> uids_;
+  // Position of each slot in live_, kInvalidUii.GetIdx() if the slot is free
+  std::vector<Ui32> live_position_;
+  std::vector<Ui32> live_;
+  std::vector<Ui32> free_;
+ public:
+  // Returns the slot idx of a connection in its initial state
+  Ui32 Add() {
+    Ui32 idx = 0;
+    if (free_.size()) {
+      idx = free_.back();
+      free_.pop_back();
+      slots_[idx].Reset();
+    } else {
+      idx = Ui32(slots_.size());
+      Check(idx < kUiiIdxMask, "ConnectionPool can't add a connection, capacity reached!");
+      slots_.emplace_back();
+      uids_.push_back(0);
+      live_position_.push_back(kInvalidUii.GetIdx());
+    }
+    live_position_[idx] = Ui32(live_.size());
+    live_.push_back(idx);
+    return idx;
+  }
+
+  // The last live connection takes the place of the removed one in GetLive().
+  // The removed one is released right away, only its slot is kept for reuse.
+  void Remove(Ui32 idx) {
+    Check(IsLive(idx), "ConnectionPool can't remove a connection that is not live.");
+    Ui32 position = live_position_[idx];
+    live_[position] = live_.back();
+    live_position_[live_[position]] = position;
+    live_.pop_back();
+    live_position_[idx] = kInvalidUii.GetIdx();
+    uids_[idx] = (uids_[idx] + 1) & kUiiUidMask;
+    free_.push_back(idx);
+    slots_[idx].Release();
+  }
+
+  bool IsLive(Ui32 idx) const {
+    return idx < live_position_.size() && live_position_[idx] != kInvalidUii.GetIdx();
+  }
+
+  Connection& operator[](Ui32 idx) {
+    return slots_[idx];
+  }
+
+  Uii GetHandle(Ui32 idx) const {
+    return Uii(idx, uids_[idx]);
+  }
+
+  // Returns the slot idx of the connection or kInvalidUii.GetIdx() if it is gone
+  Ui32 Find(Uii handle) const {
+    Ui32 idx = handle.GetIdx();
+    if (IsLive(idx) && uids_[idx] == handle.GetUid()) {
+      return idx;
+    }
+    return kInvalidUii.GetIdx();
+  }
+
+  size_t Size() const {
+    return live_.size();
+  }
+
+  // Slot idx of every live connection
+  const std::vector<Ui32>& GetLive() const {
+    return live_;
+  }
+};
+
+constexpr Ui32 kPollerListenerTag = std::numeric_limits<Ui32>::max();
+constexpr Ui32 kPollerMaxEventsPerWait = 1024;
+constexpr Si32 kDefaultInterestRadius = 5;
+constexpr Ui32 kDefaultAcceptBudget = 256;
+// Avatars per chunk of the passes over every avatar, the unit of work of a simulation thread
+constexpr Ui32 kAvatarPassChunkSize = 4096;
+// Fraction of the error the server clock corrects each tick
+constexpr double kServerClockSmoothing = 0.05;
+
+class NetServerState {
+ public:
+  UniqueItemVector<Avatar> avatars;
+  // The motion of every avatar as columns, each avatar's under its own Uii,
+  // added by AddAvatar and written by the Avatar setters and PlaceAvatar
+  AvatarColumns avatar_motion;
+  Map map;
+  ConnectionPool connections;
+  ServerListenerSocket listener_socket;
+  // When set and available, only the connections reported by the poller are updated,
+  // otherwise every connection is updated each call.
+  bool is_poller_enabled = true;
+#ifdef NET_HAS_EPOLL
+  NetPoller poller;
+#endif
+  std::vector<Ui32> awake_connections;
+  bool is_listener_ready = true;
+  // Connections accepted per tick at most, the rest wait in the listen backlog.
+  // Also the number of new UDP peers per tick, the datagrams of the rest are dropped.
+  Ui32 accept_budget = kDefaultAcceptBudget;
+  // When non-zero and supported, socket reading and writing runs on this many I/O worker
+  // threads, the simulation thread only handles whole messages and fills outgoing buffers
+  Ui32 io_worker_count = 0;
+#ifdef NET_HAS_EPOLL
+  NetIoWorkerPool io_workers;
+  std::unordered_map<Ui32, Ui32> connection_by_link;
+#endif
+  // When set with I/O workers, each worker accepts on a listener of its own bound with
+  // SO_REUSEPORT instead of the simulation thread accepting on listener_socket,
+  // so the kernel spreads the accepting over the worker threads
+  bool is_reuseport_enabled = false;
+  // When set and supported, clients may also connect over UDP to kNetworkPort.
+  // The UDP socket is always served on the simulation thread.
+  bool is_udp_enabled = false;
+#ifdef NET_HAS_EPOLL
+  PosixDatagramSocket udp_socket;
+  NetLinkConditioner udp_conditioner;
+  // By NetAddress::GetKey()
+  std::unordered_map<Ui64, Ui32> connection_by_address;
+  double next_udp_timeout_check_time = 0.0;
+#endif
+  // Connections only receive avatars within this many map cells of their own avatar.
+  // The visible sets are kept up to date as avatars move, so it must not change
+  // once there are avatars on the map.
+  Si32 interest_radius = kDefaultInterestRadius;
+  // Avatars reported by OnAvatarChanged since the last QueueChangedAvatars, each once
+  std::vector<Uii> changed_avatars;
+  // When non-zero, the passes over every avatar are spread over this many threads
+  // besides the simulation thread
+  Ui32 simulation_worker_count = 0;
+  SimWorkerPool sim_workers;
+  // Idx of the avatars UpdateMotion moves this tick, a list per chunk of the live avatars
+  std::vector<std::vector<Ui32>> moving_avatars;
+  AvatarStateCache avatar_state_cache;
+  // Simulation tick, Avatar begin_tick/end_tick are in these units
+  Ui32 tick = 0;
+  double tick_duration = 1.0 / kDefaultTicksPerSecond;
+  // Server time minus NetTime(), so that tick t starts at about t * tick_duration
+  double server_time_offset = 0.0;
+  bool is_server_clock_started = false;
+
+  NetServerState(Ui32 map_width, Ui32 map_height, Ui64 avatar_capacity);
+
+  bool IsPollerActive() {
+#ifdef NET_HAS_EPOLL
+    return is_poller_enabled && poller.IsValid();
+#else
+    return false;
+#endif
+  }
+
+  void InitPoller();
+
+  bool IsIoThreaded() {
+#ifdef NET_HAS_EPOLL
+    return io_workers.IsRunning();
+#else
+    return false;
+#endif
+  }
+
+  void InitIoWorkers();
+  void InitSimWorkers();
+  void HandleIoEvents();
+
+  bool IsAcceptingOnIoWorkers() {
+#ifdef NET_HAS_EPOLL
+    return io_workers.IsListening();
+#else
+    return false;
+#endif
+  }
+
+  void WakeConnection(Ui32 idx) {
+    Connection &rec = connections[idx];
+    if (!rec.IsAwake()) {
+      rec.SetAwake(true);
+      awake_connections.push_back(idx);
+    }
+  }
+
+  // Removes the connection along with the avatar it controls
+  void RemoveConnection(Ui32 idx);
+  // Creates the avatar of a connection that has just registered and places it on the map,
+  // a connection that registers again keeps the avatar it has
+  void SpawnAvatar(Ui32 idx);
+
+  // Adds an avatar along with its avatar_motion, returns kInvalidUii if there is no room.
+  // The avatar may be a reused one, with the fields it was freed with.
+  Uii AddAvatar();
+  // Moves the avatar to the map cell at (x, y), keeping the per-cell lists up to date
+  void PlaceAvatar(Avatar &avatar, Ui32 x, Ui32 y);
+  // Starts the avatar walking from where it is on this tick to the target cell,
+  // in state with target_uii as its target
+  void WalkAvatar(Avatar &avatar, Vec2Si32 target, ChState state = kChStateWalkToPoint,
+    Uii target_uii = kInvalidUii);
+
+  // Server time at the local NetTime() time, what clients synchronise to with Ping/Pong
+  double GetServerTime(double time) {
+    return time + server_time_offset;
+  }
+
+  // Must be called whenever replicated fields of the avatar change within a tick,
+  // dirty_flags tells which ones (usually what the Avatar setters returned), 0 is a no-op
+  void OnAvatarChanged(Avatar &avatar, Ui8 dirty_flags = kAvatarDirtyAll) {
+    if (!dirty_flags) {
+      return;
+    }
+    avatar_state_cache.Invalidate(avatar.uii);
+    if (!avatar.dirty_flags) {
+      changed_avatars.push_back(avatar.uii);
+    }
+    avatar.dirty_flags |= dirty_flags;
+  }
+
+  void RemoveAvatarFromMap(Avatar &avatar);
+  // Checks that avatar_motion agrees with every avatar, that is that nothing has changed
+  // the motion of an avatar other than through its setters
+  void CheckAvatarMotion();
+  // Moves every walking avatar to the map cell it is in on this tick, and stops the ones
+  // that got to the end of a walk to a point. Only avatar_motion is read to find them,
+  // in parallel chunks on sim_workers, the moves are then made in chunk order.
+  void UpdateMotion();
+
+  // Slot idx of the connection controlling the avatar, kInvalidUii.GetIdx() if there is none
+  Ui32 FindController(Avatar &avatar) {
+    Ui32 idx = connections.Find(avatar.connection_handle);
+    if (idx != kInvalidUii.GetIdx() && connections[idx].GetUii() != avatar.uii) {
+      return kInvalidUii.GetIdx();
+    }
+    return idx;
+  }
+
+  bool IsWithinInterest(Vec2Si32 a, Vec2Si32 b) {
+    Si32 dx = a.x - b.x;
+    Si32 dy = a.y - b.y;
+    return dx * dx + dy * dy <= interest_radius * interest_radius;
+  }
+
+  // Calls func(pos, cell) for every map cell within interest_radius of center
+  template <class Func>
+  void ForEachCellWithinInterest(Vec2Si32 center, Func func) {
+    Si32 r = interest_radius;
+    Si32 min_y = std::max(center.y - r, 0);
+    Si32 max_y = std::min(center.y + r, Si32(map.Height()) - 1);
+    Si32 min_x = std::max(center.x - r, 0);
+    Si32 max_x = std::min(center.x + r, Si32(map.Width()) - 1);
+    for (Si32 y = min_y; y <= max_y; ++y) {
+      for (Si32 x = min_x; x <= max_x; ++x) {
+        Vec2Si32 pos(x, y);
+        if (IsWithinInterest(pos, center)) {
+          func(pos, map.At(Ui32(x), Ui32(y)));
+        }
+      }
+    }
+  }
+
+  // Calls func(avatar) for every avatar in the cell
+  template <class Func>
+  void ForEachAvatarInCell(MapCell &cell, Func func) {
+    if (cell.GetItems() == kInvalidUii.GetIdx()) {
+      return;
+    }
+    for (UniqueItemBase *item = &avatars[cell.GetItems()]; item; item = item->GetNext()) {
+      func(*static_cast<Avatar*>(item));
+    }
+  }
+
+  // Called as the avatar moves from one map cell to another, from or to is null when
+  // it is placed on the map or removed from it. Interest is symmetric, so only the
+  // connection controlling the avatar and the ones with their avatar within
+  // interest_radius of either cell can see anything enter or leave: the former
+  // diffs the cells that came into and went out of its radius, the latter
+  // see the avatar itself enter or leave.
+  void UpdateInterest(Avatar &avatar, MapCell *from, MapCell *to);
+  // Queues each avatar changed since the last call on the connections that can see it.
+  // Those are found among the avatars within interest_radius of it, so the cost depends
+  // on how many avatars changed, not on how many there are.
+  void QueueChangedAvatars();
+
+  // Runs a whole tick: UpdateNetworkInput, UpdateSimulation(tick + 1), UpdateReplication
+  void UpdateServer();
+  // Accepts new connections and handles the messages received since the last tick
+  void UpdateNetworkInput();
+  // Advances the simulation to in_tick, spawning the avatars of the newly registered
+  // connections, applying the player commands received and moving the avatars
+  void UpdateSimulation(Ui32 in_tick);
+  // Sends the resulting state to the connections
+  void UpdateReplication();
+  // Binds listener_socket to kNetworkPort, leaves it invalid on failure
+  void StartListener();
+  // Accepts up to accept_budget connections waiting on listener_socket
+  void AcceptConnections();
+  // Reads every datagram the UDP socket has and times out silent UDP connections
+  void UpdateUdpInput();
+  void SendDatagram(const NetAddress &address, const char *data, Si32 size);
+};
+
+}  // namespace arctic
+
+#endif /* net_server_hpp */
@@ -0,0 +1,273 @@
+#include "net_socket.hpp"
+
+#ifdef NET_HAS_EPOLL
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+
+namespace arctic {
+
+void PosixSocket::SetLastError(const char *operation, int error_code) {
+  last_error_ = std::string(operation) + ": " + strerror(error_code);
+}
+
+PosixSocket::PosixSocket(PosixSocket &&other)
+    : handle_(std::exchange(other.handle_, -1))
+    , last_error_(std::move(other.last_error_)) {
+}
+
+PosixSocket& PosixSocket::operator=(PosixSocket &&other) {
+  if (this != &other) {
+    Close();
+    handle_ = std::exchange(other.handle_, -1);
+    last_error_ = std::move(other.last_error_);
+  }
+  return *this;
+}
+
+PosixSocket::~PosixSocket() {
+  Close();
+}
+
+void PosixSocket::Close() {
+  if (handle_ != -1) {
+    close(handle_);
+    handle_ = -1;
+  }
+}
+
+int PosixSocket::Release() {
+  return std::exchange(handle_, -1);
+}
+
+SocketResult PosixSocket::SetSoLinger(bool is_enabled, Ui16 linger_seconds) {
+  linger l;
+  l.l_onoff = is_enabled ? 1 : 0;
+  l.l_linger = linger_seconds;
+  if (setsockopt(handle_, SOL_SOCKET, SO_LINGER, &l, sizeof(l)) != 0) {
+    SetLastError("setsockopt SO_LINGER", errno);
+    return kSocketError;
+  }
+  return kSocketOk;
+}
+
+SocketResult PosixSocket::SetSoNonblocking(bool is_enabled) {
+  int flags = fcntl(handle_, F_GETFL, 0);
+  if (flags == -1) {
+    SetLastError("fcntl F_GETFL", errno);
+    return kSocketError;
+  }
+  flags = is_enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  if (fcntl(handle_, F_SETFL, flags) != 0) {
+    SetLastError("fcntl F_SETFL", errno);
+    return kSocketError;
+  }
+  return kSocketOk;
+}
+
+SocketResult PosixConnectionSocket::Read(char *buffer, size_t length, size_t *out_size) {
+  *out_size = 0;
+  if (handle_ == -1) {
+    last_error_ = "Read: socket is closed";
+    return kSocketError;
+  }
+  if (length == 0) {
+    return kSocketOk;
+  }
+  ssize_t res = recv(handle_, buffer, length, 0);
+  if (res > 0) {
+    *out_size = size_t(res);
+    return kSocketOk;
+  }
+  if (res == 0) {
+    last_error_ = "Read: connection closed by peer";
+    Close();
+    return kSocketConnectionReset;
+  }
+  int error_code = errno;
+  if (error_code == EAGAIN || error_code == EWOULDBLOCK || error_code == EINTR) {
+    return kSocketOk;
+  }
+  SetLastError("recv", error_code);
+  Close();
+  return error_code == ECONNRESET ? kSocketConnectionReset : kSocketError;
+}
+
+SocketResult PosixConnectionSocket::Write(const char *buffer, size_t length, size_t *out_size) {
+  *out_size = 0;
+  if (handle_ == -1) {
+    last_error_ = "Write: socket is closed";
+    return kSocketError;
+  }
+  ssize_t res = send(handle_, buffer, length, MSG_NOSIGNAL);
+  if (res >= 0) {
+    *out_size = size_t(res);
+    return kSocketOk;
+  }
+  int error_code = errno;
+  if (error_code == EAGAIN || error_code == EWOULDBLOCK || error_code == EINTR) {
+    return kSocketOk;
+  }
+  SetLastError("send", error_code);
+  Close();
+  return (error_code == ECONNRESET || error_code == EPIPE) ? kSocketConnectionReset : kSocketError;
+}
+
+PosixListenerSocket::PosixListenerSocket(AddressFamily address_family, SocketProtocol protocol) {
+  int domain = (address_family == AddressFamily::kIpV6 ? AF_INET6 : AF_INET);
+  int type = (protocol == SocketProtocol::kUdp ? SOCK_DGRAM : SOCK_STREAM);
+  handle_ = socket(domain, type | SOCK_CLOEXEC, 0);
+  if (handle_ == -1) {
+    SetLastError("socket", errno);
+  }
+}
+
+SocketResult PosixListenerSocket::SetSoReuseport(bool is_enabled) {
+  int value = is_enabled ? 1 : 0;
+  if (setsockopt(handle_, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) != 0) {
+    SetLastError("setsockopt SO_REUSEPORT", errno);
+    return kSocketError;
+  }
+  return kSocketOk;
+}
+
+SocketResult PosixListenerSocket::Bind(const char *address, Ui16 port, Si32 backlog) {
+  sockaddr_storage storage;
+  memset(&storage, 0, sizeof(storage));
+  socklen_t storage_size = 0;
+  sockaddr_in *addr4 = reinterpret_cast<sockaddr_in*>(&storage);
+  sockaddr_in6 *addr6 = reinterpret_cast<sockaddr_in6*>(&storage);
+  if (inet_pton(AF_INET, address, &addr4->sin_addr) == 1) {
+    addr4->sin_family = AF_INET;
+    addr4->sin_port = htons(port);
+    storage_size = sizeof(sockaddr_in);
+  } else if (inet_pton(AF_INET6, address, &addr6->sin6_addr) == 1) {
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_port = htons(port);
+    storage_size = sizeof(sockaddr_in6);
+  } else {
+    last_error_ = std::string("Bind: can't parse address ") + address;
+    return kSocketError;
+  }
+  if (bind(handle_, reinterpret_cast<sockaddr*>(&storage), storage_size) != 0) {
+    SetLastError("bind", errno);
+    return kSocketError;
+  }
+  if (listen(handle_, backlog) != 0) {
+    SetLastError("listen", errno);
+    return kSocketError;
+  }
+  return kSocketOk;
+}
+
+PosixConnectionSocket PosixListenerSocket::Accept() {
+  int handle = accept4(handle_, nullptr, nullptr, SOCK_CLOEXEC);
+  if (handle == -1) {
+    int error_code = errno;
+    if (error_code != EAGAIN && error_code != EWOULDBLOCK && error_code != EINTR) {
+      SetLastError("accept", error_code);
+    }
+    return PosixConnectionSocket();
+  }
+  return PosixConnectionSocket(handle);
+}
+
+bool ParseNetAddress(const char *address, Ui16 port, NetAddress *out_address) {
+  in_addr addr;
+  if (inet_pton(AF_INET, address, &addr) != 1) {
+    return false;
+  }
+  out_address->ip = addr.s_addr;
+  out_address->port = htons(port);
+  return true;
+}
+
+SocketResult PosixDatagramSocket::Open() {
+  Close();
+  handle_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (handle_ == -1) {
+    SetLastError("socket", errno);
+    return kSocketError;
+  }
+  return kSocketOk;
+}
+
+SocketResult PosixDatagramSocket::Bind(const char *address, Ui16 port) {
+  NetAddress net_address;
+  if (!ParseNetAddress(address, port, &net_address)) {
+    last_error_ = std::string("Bind: can't parse address ") + address;
+    return kSocketError;
+  }
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = net_address.ip;
+  addr.sin_port = net_address.port;
+  if (bind(handle_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    SetLastError("bind", errno);
+    return kSocketError;
+  }
+  return kSocketOk;
+}
+
+SocketResult PosixDatagramSocket::ReceiveFrom(char *buffer, size_t length, size_t *out_size,
+    NetAddress *out_address) {
+  *out_size = 0;
+  if (handle_ == -1) {
+    last_error_ = "ReceiveFrom: socket is closed";
+    return kSocketError;
+  }
+  sockaddr_in addr;
+  socklen_t addr_size = sizeof(addr);
+  ssize_t res = recvfrom(handle_, buffer, length, 0, reinterpret_cast<sockaddr*>(&addr), &addr_size);
+  if (res >= 0) {
+    if (addr_size >= socklen_t(sizeof(addr)) && addr.sin_family == AF_INET) {
+      *out_size = size_t(res);
+      out_address->ip = addr.sin_addr.s_addr;
+      out_address->port = addr.sin_port;
+    }
+    return kSocketOk;
+  }
+  int error_code = errno;
+  // ECONNREFUSED is an ICMP error left by an earlier datagram, the socket is fine
+  if (error_code == EAGAIN || error_code == EWOULDBLOCK || error_code == EINTR ||
+      error_code == ECONNREFUSED) {
+    return kSocketOk;
+  }
+  SetLastError("recvfrom", error_code);
+  return kSocketError;
+}
+
+SocketResult PosixDatagramSocket::SendTo(const char *data, size_t size, const NetAddress &address) {
+  if (handle_ == -1) {
+    last_error_ = "SendTo: socket is closed";
+    return kSocketError;
+  }
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = address.ip;
+  addr.sin_port = address.port;
+  ssize_t res = sendto(handle_, data, size, MSG_NOSIGNAL,
+    reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+  if (res >= 0) {
+    return kSocketOk;
+  }
+  int error_code = errno;
+  if (error_code == EAGAIN || error_code == EWOULDBLOCK || error_code == EINTR ||
+      error_code == ENOBUFS || error_code == ECONNREFUSED) {
+    return kSocketOk;
+  }
+  SetLastError("sendto", error_code);
+  return kSocketError;
+}
+
+}  // namespace arctic
+
+#endif  // NET_HAS_EPOLL
@@ -0,0 +1,126 @@
+#ifndef net_socket_hpp
+#define net_socket_hpp
+
+#include <string>
+#include "engine/arctic_types.h"
+#include "engine/arctic_platform_tcpip.h"
+
+#if defined(__linux__)
+#define NET_HAS_EPOLL 1
+#endif
+
+namespace arctic {
+
+#ifdef NET_HAS_EPOLL
+
+// Thin wrappers over raw POSIX sockets with the same interface as
+// ConnectionSocket/ListenerSocket, but exposing the native handle so the
+// server can register it with epoll.
+class PosixSocket {
+ protected:
+  int handle_ = -1;
+  std::string last_error_;
+
+  void SetLastError(const char *operation, int error_code);
+ public:
+  PosixSocket() {
+  }
+  explicit PosixSocket(int handle)
+    : handle_(handle) {
+  }
+  PosixSocket(const PosixSocket&) = delete;
+  PosixSocket& operator=(const PosixSocket&) = delete;
+  PosixSocket(PosixSocket &&other);
+  PosixSocket& operator=(PosixSocket &&other);
+  ~PosixSocket();
+
+  bool IsValid() const {
+    return handle_ != -1;
+  }
+  int GetNativeHandle() const {
+    return handle_;
+  }
+  const std::string& GetLastError() const {
+    return last_error_;
+  }
+  SocketResult SetSoLinger(bool is_enabled, Ui16 linger_seconds);
+  SocketResult SetSoNonblocking(bool is_enabled);
+  void Close();
+  // Gives up the ownership of the native handle without closing it
+  int Release();
+};
+
+class PosixConnectionSocket : public PosixSocket {
+ public:
+  PosixConnectionSocket() {
+  }
+  explicit PosixConnectionSocket(int handle)
+    : PosixSocket(handle) {
+  }
+  // Returns kSocketOk with *out_size == 0 if there is nothing to read yet.
+  // Closes the socket when the peer disconnects or on a hard error.
+  SocketResult Read(char *buffer, size_t length, size_t *out_size);
+  SocketResult Write(const char *buffer, size_t length, size_t *out_size);
+};
+
+class PosixListenerSocket : public PosixSocket {
+ public:
+  PosixListenerSocket() {
+  }
+  explicit PosixListenerSocket(int handle)
+    : PosixSocket(handle) {
+  }
+  PosixListenerSocket(AddressFamily address_family, SocketProtocol protocol);
+  // Lets several listeners bind the same address and port, the kernel spreads
+  // the incoming connections over them. Must be set before Bind.
+  SocketResult SetSoReuseport(bool is_enabled);
+  SocketResult Bind(const char *address, Ui16 port, Si32 backlog = 1024);
+  PosixConnectionSocket Accept();
+};
+
+// IPv4 address and port of a datagram peer, both in network byte order
+struct NetAddress {
+  Ui32 ip = 0;
+  Ui16 port = 0;
+
+  Ui64 GetKey() const {
+    return (Ui64(ip) << 16) | port;
+  }
+  bool operator==(const NetAddress &right) const {
+    return ip == right.ip && port == right.port;
+  }
+  bool operator!=(const NetAddress &right) const {
+    return !(*this == right);
+  }
+};
+
+// Returns false if address is not a numeric IPv4 address
+bool ParseNetAddress(const char *address, Ui16 port, NetAddress *out_address);
+
+// Non-blocking UDP socket
+class PosixDatagramSocket : public PosixSocket {
+ public:
+  PosixDatagramSocket() {
+  }
+  SocketResult Open();
+  SocketResult Bind(const char *address, Ui16 port);
+  // Returns kSocketOk with *out_size == 0 if there is no datagram to read yet.
+  // A datagram longer than length is truncated.
+  SocketResult ReceiveFrom(char *buffer, size_t length, size_t *out_size, NetAddress *out_address);
+  // A full send buffer drops the datagram, as the network would
+  SocketResult SendTo(const char *data, size_t size, const NetAddress &address);
+};
+
+typedef PosixConnectionSocket ServerConnectionSocket;
+typedef PosixListenerSocket ServerListenerSocket;
+
+#else
+
+typedef ConnectionSocket ServerConnectionSocket;
+typedef ListenerSocket ServerListenerSocket;
+
+#endif  // NET_HAS_EPOLL
+
+}  // namespace arctic
+
+#endif /* net_socket_hpp */
@@ -0,0 +1,101 @@
+// Copyright (c) <year> Your name
+
+// Entry point of the headless dedicated server (the_inmost_trail_server).
+// Links only the networking and the simulation, no window, sound or GL.
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include "engine/log.h"
+#include "world.hpp"
+#include "net_server.hpp"
+#include "tick_scheduler.hpp"
+
+using namespace arctic;  // NOLINT
+
+constexpr Ui32 kServerMapWidth = 1024;
+constexpr Ui32 kServerMapHeight = 1024;
+
+volatile std::sig_atomic_t g_is_stop_requested = 0;
+
+void OnStopSignal(int) {
+  g_is_stop_requested = 1;
+}
+
+// Parses "--name=<value>" into *out_value, returns false if arg is not that option
+bool ParseUi32Arg(const char *arg, const char *name, Ui32 min_value, Ui32 *out_value) {
+  size_t name_length = strlen(name);
+  if (strncmp(arg, name, name_length) != 0 || arg[name_length] != '=') {
+    return false;
+  }
+  Si32 value = atoi(arg + name_length + 1);
+  if (value >= Si32(min_value)) {
+    *out_value = Ui32(value);
+  } else {
+    *Log() << "Ignoring invalid " << arg;
+  }
+  return true;
+}
+
+// Usage: the_inmost_trail_server [--tick-rate=<ticks per second>] [--io-threads=<count>]
+//   [--sim-threads=<count>] [--reuseport=<0|1>] [--accept-budget=<connections per tick>]
+//   [--udp=<0|1>] [--udp-loss=<percent>] [--udp-reorder=<percent>]
+// With --reuseport=1 each I/O thread accepts on a listener of its own.
+// --sim-threads spreads the passes over every avatar over that many more threads.
+// The UDP loss and reorder options simulate a bad network on the server's sends, for testing.
+int main(int argc, char **argv) {
+  StartLogger();
+  std::signal(SIGINT, OnStopSignal);
+  std::signal(SIGTERM, OnStopSignal);
+
+  Ui32 ticks_per_second = kDefaultTicksPerSecond;
+  Ui32 io_thread_count = 0;
+  Ui32 sim_thread_count = 0;
+  Ui32 is_reuseport_enabled = 0;
+  Ui32 accept_budget = kDefaultAcceptBudget;
+  Ui32 is_udp_enabled = 0;
+  Ui32 udp_loss_percent = 0;
+  Ui32 udp_reorder_percent = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!ParseUi32Arg(argv[i], "--tick-rate", 1, &ticks_per_second) &&
+        !ParseUi32Arg(argv[i], "--io-threads", 0, &io_thread_count) &&
+        !ParseUi32Arg(argv[i], "--sim-threads", 0, &sim_thread_count) &&
+        !ParseUi32Arg(argv[i], "--reuseport", 0, &is_reuseport_enabled) &&
+        !ParseUi32Arg(argv[i], "--accept-budget", 1, &accept_budget) &&
+        !ParseUi32Arg(argv[i], "--udp", 0, &is_udp_enabled) &&
+        !ParseUi32Arg(argv[i], "--udp-loss", 0, &udp_loss_percent) &&
+        !ParseUi32Arg(argv[i], "--udp-reorder", 0, &udp_reorder_percent)) {
+      *Log() << "Ignoring unknown argument " << argv[i];
+    }
+  }
+
+  NetServerState server(kServerMapWidth, kServerMapHeight, kAvatarCount);
+  server.io_worker_count = io_thread_count;
+  server.simulation_worker_count = sim_thread_count;
+  server.is_reuseport_enabled = (is_reuseport_enabled != 0);
+  server.accept_budget = accept_budget;
+  server.is_udp_enabled = (is_udp_enabled != 0);
+#ifdef NET_HAS_EPOLL
+  server.udp_conditioner.Configure(udp_loss_percent / 100.0, udp_reorder_percent / 100.0, 1);
+#endif
+  TickScheduler scheduler(ticks_per_second);
+  server.tick_duration = scheduler.GetTickDuration();
+  *Log() << NetTime() << " Server started, " << ticks_per_second << " ticks per second, "
+    << io_thread_count << " I/O threads, " << sim_thread_count << " simulation threads"
+    << (server.is_udp_enabled ? ", UDP enabled" : "");
+
+  while (!g_is_stop_requested) {
+    Ui32 tick = scheduler.Wait();
+    scheduler.BeginPhase(kTickPhaseNetworkInput);
+    server.UpdateNetworkInput();
+    scheduler.BeginPhase(kTickPhaseSimulation);
+    server.UpdateSimulation(tick);
+    scheduler.BeginPhase(kTickPhaseReplication);
+    server.UpdateReplication();
+    scheduler.EndTick();
+  }
+
+  *Log() << NetTime() << " Server stopped";
+  StopLogger();
+  return 0;
+}
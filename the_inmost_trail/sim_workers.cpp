@@ -0,0 +1,96 @@
+#include "sim_workers.hpp"
+
+namespace arctic {
+
+SimWorkerPool::SimWorkerPool()
+    : next_task_idx_(0) {
+}
+
+SimWorkerPool::~SimWorkerPool() {
+  Stop();
+}
+
+void SimWorkerPool::Start(Ui32 thread_count) {
+  Stop();
+  is_stop_requested_ = false;
+  // Threads only take up passes started after this one
+  Ui64 generation = generation_;
+  for (Ui32 i = 0; i < thread_count; ++i) {
+    threads_.emplace_back([this, generation]() { Run(generation); });
+  }
+}
+
+void SimWorkerPool::Stop() {
+  if (threads_.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_stop_requested_ = true;
+  }
+  start_condition_.notify_all();
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+  threads_.clear();
+}
+
+void SimWorkerPool::Run(Ui64 generation) {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_condition_.wait(lock, [&]() {
+        return is_stop_requested_ || generation_ != generation;
+      });
+      if (is_stop_requested_) {
+        return;
+      }
+      generation = generation_;
+    }
+    RunTasks();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --busy_thread_count_;
+      if (busy_thread_count_ == 0) {
+        done_condition_.notify_one();
+      }
+    }
+  }
+}
+
+void SimWorkerPool::RunTasks() {
+  while (true) {
+    Ui32 task_idx = next_task_idx_.fetch_add(1, std::memory_order_relaxed);
+    if (task_idx >= task_count_) {
+      return;
+    }
+    task_func_(task_context_, task_idx);
+  }
+}
+
+void SimWorkerPool::RunPass(Ui32 task_count, TaskFunc task_func, void *task_context) {
+  if (threads_.empty() || task_count < 2) {
+    for (Ui32 task_idx = 0; task_idx < task_count; ++task_idx) {
+      task_func(task_context, task_idx);
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_func_ = task_func;
+    task_context_ = task_context;
+    task_count_ = task_count;
+    next_task_idx_.store(0, std::memory_order_relaxed);
+    busy_thread_count_ = Ui32(threads_.size());
+    ++generation_;
+  }
+  start_condition_.notify_all();
+  RunTasks();
+  // The threads that found no task left still have to check in, then the pass is over
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_condition_.wait(lock, [&]() {
+    return busy_thread_count_ == 0;
+  });
+}
+
+}  // namespace arctic
@@ -0,0 +1,62 @@
+#ifndef sim_workers_hpp
+#define sim_workers_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "engine/arctic_types.h"
+
+namespace arctic {
+
+// Spreads the chunks of a simulation pass over threads that persist from tick to tick.
+// The calling thread works on the chunks too and ParallelFor returns once all are done,
+// so a pass is split in two: a parallel phase in which each chunk only reads shared state
+// and writes its own output, and a serial one that applies the outputs in chunk order.
+// All the methods must be called from the simulation thread.
+class SimWorkerPool {
+  typedef void (*TaskFunc)(void *context, Ui32 task_idx);
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable start_condition_;
+  std::condition_variable done_condition_;
+  // The current pass, set under mutex_ before generation_ changes
+  TaskFunc task_func_ = nullptr;
+  void *task_context_ = nullptr;
+  Ui32 task_count_ = 0;
+  std::atomic<Ui32> next_task_idx_;
+  Ui32 busy_thread_count_ = 0;
+  Ui64 generation_ = 0;
+  bool is_stop_requested_ = false;
+
+  void Run(Ui64 generation);
+  void RunTasks();
+  void RunPass(Ui32 task_count, TaskFunc task_func, void *task_context);
+ public:
+  SimWorkerPool();
+  SimWorkerPool(const SimWorkerPool&) = delete;
+  SimWorkerPool& operator=(const SimWorkerPool&) = delete;
+  ~SimWorkerPool();
+
+  // Starts thread_count threads besides the calling one
+  void Start(Ui32 thread_count);
+  void Stop();
+  bool IsRunning() const {
+    return !threads_.empty();
+  }
+
+  // Calls func(task_idx) for every task_idx below task_count, in any order and on any
+  // of the threads, and returns once every call has returned
+  template <class Func>
+  void ParallelFor(Ui32 task_count, Func &func) {
+    RunPass(task_count, [](void *context, Ui32 task_idx) {
+      (*static_cast<Func*>(context))(task_idx);
+    }, &func);
+  }
+};
+
+}  // namespace arctic
+
+#endif /* sim_workers_hpp */
@@ -0,0 +1,64 @@
+#ifndef spsc_queue_hpp
+#define spsc_queue_hpp
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include "engine/arctic_types.h"
+
+namespace arctic {
+
+constexpr size_t kCacheLineSize = 64;
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// Capacity is rounded up to a power of two.
+template <class T>
+class SpscQueue {
+  std::vector<T> items_;
+  size_t mask_;
+  // Next slot to pop, written only by the consumer
+  std::atomic<size_t> head_;
+  char head_padding_[kCacheLineSize - sizeof(std::atomic<size_t>)];
+  // Next slot to push, written only by the producer
+  std::atomic<size_t> tail_;
+  char tail_padding_[kCacheLineSize - sizeof(std::atomic<size_t>)];
+ public:
+  explicit SpscQueue(size_t capacity)
+    : head_(0)
+    , tail_(0) {
+    size_t size = 1;
+    while (size < capacity) {
+      size *= 2;
+    }
+    items_.resize(size);
+    mask_ = size - 1;
+  }
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  // Producer only. Returns false if the queue is full.
+  bool TryPush(const T &item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == items_.size()) {
+      return false;
+    }
+    items_[tail & mask_] = item;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Returns false if the queue is empty.
+  bool TryPop(T *out_item) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *out_item = items_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+}  // namespace arctic
+
+#endif /* spsc_queue_hpp */
@@ -0,0 +1,118 @@
+#include "tick_scheduler.hpp"
+
+#include <algorithm>
+#include <thread>
+#include "engine/arctic_platform_fatal.h"
+#include "engine/log.h"
+
+namespace arctic {
+
+// sleep_until usually wakes up late, the last bit of the wait is spent yielding
+constexpr std::chrono::microseconds kTickSpinMargin(1000);
+
+static const char *g_tick_phase_name[kTickPhaseCount] = {
+  "input",
+  "simulation",
+  "replication"
+};
+
+TickScheduler::TickScheduler(Ui32 ticks_per_second, Ui32 max_catch_up_ticks,
+    double report_interval)
+    : max_catch_up_ticks_(max_catch_up_ticks) {
+  Check(ticks_per_second > 0, "TickScheduler needs at least one tick per second.");
+  tick_duration_ = std::chrono::duration_cast<Clock::duration>(
+    std::chrono::duration<double>(1.0 / ticks_per_second));
+  report_interval_ = std::chrono::duration_cast<Clock::duration>(
+    std::chrono::duration<double>(report_interval));
+  next_tick_time_ = Clock::now();
+  report_begin_time_ = next_tick_time_;
+}
+
+Ui32 TickScheduler::Wait() {
+  Clock::time_point now = Clock::now();
+  if (next_tick_time_ - now > kTickSpinMargin) {
+    std::this_thread::sleep_until(next_tick_time_ - kTickSpinMargin);
+  }
+  while ((now = Clock::now()) < next_tick_time_) {
+    std::this_thread::yield();
+  }
+  Clock::duration max_lateness = tick_duration_ * max_catch_up_ticks_;
+  if (now - next_tick_time_ > max_lateness) {
+    // Too far behind, drop the ticks that can't be caught up with
+    Ui32 dropped = Ui32((now - next_tick_time_ - max_lateness) / tick_duration_);
+    next_tick_time_ += tick_duration_ * dropped;
+    report_dropped_count_ += dropped;
+  }
+
+  ++tick_;
+  current_ = TickStats();
+  current_.tick = tick_;
+  current_.lateness = std::chrono::duration<double>(now - next_tick_time_).count();
+  tick_begin_time_ = now;
+  phase_begin_time_ = now;
+  phase_ = -1;
+  next_tick_time_ += tick_duration_;
+  return tick_;
+}
+
+void TickScheduler::EndPhase(Clock::time_point now) {
+  if (phase_ >= 0) {
+    current_.phase[phase_] += std::chrono::duration<double>(now - phase_begin_time_).count();
+  }
+  phase_begin_time_ = now;
+}
+
+void TickScheduler::BeginPhase(TickPhase phase) {
+  EndPhase(Clock::now());
+  phase_ = phase;
+}
+
+void TickScheduler::EndTick() {
+  Clock::time_point now = Clock::now();
+  EndPhase(now);
+  phase_ = -1;
+  current_.busy = std::chrono::duration<double>(now - tick_begin_time_).count();
+  last_ = current_;
+
+  ++report_tick_count_;
+  if (current_.busy > GetTickDuration()) {
+    ++report_overloaded_count_;
+  }
+  for (Si32 i = 0; i < kTickPhaseCount; ++i) {
+    report_phase_sum_[i] += current_.phase[i];
+  }
+  report_busy_sum_ += current_.busy;
+  if (current_.busy > report_worst_.busy) {
+    report_worst_ = current_;
+  }
+  if (now - report_begin_time_ >= report_interval_) {
+    Report(now);
+  }
+}
+
+void TickScheduler::Report(Clock::time_point now) {
+  double budget = GetTickDuration();
+  auto log = Log();
+  *log << "Ticks " << report_tick_count_ << " up to " << tick_
+    << ", budget used avg " << (report_busy_sum_ / report_tick_count_ / budget * 100.0) << "%"
+    << " max " << (report_worst_.busy / budget * 100.0) << "% (tick " << report_worst_.tick << ")"
+    << ", overloaded " << report_overloaded_count_ << ", dropped " << report_dropped_count_
+    << ", avg ms";
+  for (Si32 i = 0; i < kTickPhaseCount; ++i) {
+    *log << " " << g_tick_phase_name[i] << " " << (report_phase_sum_[i] / report_tick_count_ * 1000.0);
+  }
+  *log << ", worst tick ms";
+  for (Si32 i = 0; i < kTickPhaseCount; ++i) {
+    *log << " " << g_tick_phase_name[i] << " " << (report_worst_.phase[i] * 1000.0);
+  }
+
+  report_begin_time_ = now;
+  report_tick_count_ = 0;
+  report_overloaded_count_ = 0;
+  report_dropped_count_ = 0;
+  std::fill(report_phase_sum_, report_phase_sum_ + kTickPhaseCount, 0.0);
+  report_busy_sum_ = 0.0;
+  report_worst_ = TickStats();
+}
+
+}  // namespace arctic
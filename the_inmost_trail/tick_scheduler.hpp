@@ -0,0 +1,84 @@
+#ifndef tick_scheduler_hpp
+#define tick_scheduler_hpp
+
+#include <chrono>
+#include "engine/arctic_types.h"
+
+namespace arctic {
+
+// Parts of a server tick whose time is accounted separately
+enum TickPhase {
+  kTickPhaseNetworkInput = 0,
+  kTickPhaseSimulation,
+  kTickPhaseReplication,
+  kTickPhaseCount
+};
+
+constexpr Ui32 kDefaultMaxCatchUpTicks = 5;
+constexpr double kDefaultTickReportInterval = 10.0;
+
+// Time spent in one tick, in seconds
+struct TickStats {
+  Ui32 tick = 0;
+  double phase[kTickPhaseCount] = {};
+  double busy = 0.0;
+  // How much later than scheduled the tick started
+  double lateness = 0.0;
+};
+
+// Advances an integer tick at a fixed rate.
+// Usage: Wait(); BeginPhase(...) for each phase; EndTick(); repeat.
+// Wait sleeps until the next tick is due. Ticks that are late run back to back
+// to catch up, but never more than max_catch_up_ticks behind: older ticks are
+// dropped, so an overloaded server slows its simulation down instead of falling
+// further and further behind.
+// The per-phase times are written to the log every report_interval seconds.
+class TickScheduler {
+  typedef std::chrono::steady_clock Clock;
+
+  Clock::duration tick_duration_;
+  Ui32 max_catch_up_ticks_;
+  Ui32 tick_ = 0;
+  Clock::time_point next_tick_time_;
+  Clock::time_point tick_begin_time_;
+  Clock::time_point phase_begin_time_;
+  Si32 phase_ = -1;
+  TickStats current_;
+  TickStats last_;
+
+  // Aggregated since the last report
+  Clock::duration report_interval_;
+  Clock::time_point report_begin_time_;
+  Ui32 report_tick_count_ = 0;
+  Ui32 report_overloaded_count_ = 0;
+  Ui32 report_dropped_count_ = 0;
+  double report_phase_sum_[kTickPhaseCount] = {};
+  double report_busy_sum_ = 0.0;
+  TickStats report_worst_;
+
+  void EndPhase(Clock::time_point now);
+  void Report(Clock::time_point now);
+ public:
+  explicit TickScheduler(Ui32 ticks_per_second,
+    Ui32 max_catch_up_ticks = kDefaultMaxCatchUpTicks,
+    double report_interval = kDefaultTickReportInterval);
+
+  Ui32 GetTick() const {
+    return tick_;
+  }
+  double GetTickDuration() const {
+    return std::chrono::duration<double>(tick_duration_).count();
+  }
+  const TickStats& GetLastTickStats() const {
+    return last_;
+  }
+
+  // Sleeps until the next tick is due, then starts it. Returns the new tick.
+  Ui32 Wait();
+  void BeginPhase(TickPhase phase);
+  void EndTick();
+};
+
+}  // namespace arctic
+
+#endif /* tick_scheduler_hpp */
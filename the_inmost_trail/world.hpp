@@ -0,0 +1,743 @@
+#ifndef world_hpp
+#define world_hpp
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "engine/arctic_types.h"
+#include "engine/arctic_platform_fatal.h"
+#include "engine/vec2si32.h"
+
+namespace arctic {
+
+constexpr Ui32 kAvatarCount = 100'000;
+
+constexpr Ui32 kUiiIdxBits = 20;
+constexpr Ui32 kUiiUidBits = 32 - kUiiIdxBits;
+
+constexpr Ui32 kUiiIdxMask = (Ui32(1) << kUiiIdxBits) - 1;
+constexpr Ui32 kUiiUidMask = ((Ui32(1) << kUiiUidBits) - 1);
+
+constexpr Ui32 kUiiUidStep = (Ui32(1) << kUiiIdxBits);
+
+struct Uii {
+  Ui32 value;
+  Ui32 GetIdx() const {
+    return (value & ((Ui32(1) << kUiiIdxBits) - 1));
+  }
+  Ui32 GetUid() const {
+    return (value >> kUiiIdxBits);
+  }
+  void Set(Ui32 idx, Ui32 uid) {
+    value = ((idx & kUiiIdxMask) | ((uid & kUiiUidMask) << kUiiIdxBits));
+  }
+  void NextUid() {
+    value += kUiiUidStep;
+  }
+  Uii(Ui32 idx, Ui32 uid) {
+    Set(idx, uid);
+  }
+  Uii()
+    : value(Ui32(-1)) {
+  }
+  bool operator==(const Uii& right) const {
+    return value == right.value;
+  }
+  bool operator!=(const Uii& right) const {
+    return value != right.value;
+  }
+};
+
+const Uii kInvalidUii = Uii(kUiiIdxMask, kUiiUidMask);
+
+class MapCell {
+  Ui32 items_ : kUiiIdxBits;
+  Ui32 type_ : 32 - kUiiIdxBits;
+ public:
+  MapCell()
+    : items_(kUiiIdxMask)
+    , type_(0) {
+  }
+  void SetItems(Ui32 items) {
+    items_ = items;
+  }
+  Ui32 GetItems() {
+    return items_;
+  }
+};
+static_assert(sizeof(MapCell) == 4, "sizeof(MapCell) must be 4, error!");
+
+template <class T>
+class UniqueItemVector;
+
+class UniqueItemBase;
+
+class UniqueItemBase {
+ protected:
+  UniqueItemBase *next_ = nullptr; // Either next free or next on map
+  UniqueItemBase *prev_ = nullptr; // Either next free or next on map
+  MapCell *cell_ = nullptr;
+ public:
+  Uii uii;
+  template <class T> friend class UniqueItemVector;
+  void AddToListBefore(UniqueItemBase *p) {
+    Check(p->prev_ == nullptr, "UniqueItemBase can't AddToList item that is already in a list!");
+    Check(p->next_ == nullptr, "UniqueItemBase can't AddToList item that is already in a list!");
+    p->prev_ = this->prev_;
+    p->next_ = this;
+    if (p->prev_) {
+      p->prev_->next_ = p;
+    }
+    this->prev_ = p;
+  }
+  void SetCell(MapCell *cell) {
+    cell_ = cell;
+  }
+  MapCell* GetCell() {
+    return cell_;
+  }
+  // Next item in the same map cell
+  UniqueItemBase* GetNext() {
+    return next_;
+  }
+
+  template <class T> friend class UniqueItemVector;
+
+  template <class T>
+  void AddToCell(MapCell *cell, UniqueItemVector<T> &v) {
+    cell_ = cell;
+    if (cell_->GetItems() != kInvalidUii.GetIdx()) {
+      UniqueItemBase* list = &v[cell->GetItems()];
+      list->AddToListBefore(this);
+    }
+    cell->SetItems(uii.GetIdx());
+  }
+
+  UniqueItemBase* RemoveFromListGetNext() {
+    UniqueItemBase *next = next_;
+    if (next_) {
+      next_->prev_ = prev_;
+      next_ = nullptr;
+    }
+    if (prev_) {
+      prev_->next_ = next;
+      prev_ = nullptr;
+    } else {
+      if (cell_) {
+        Uii uii = kInvalidUii;
+        if (next) {
+          uii = next->uii;
+        }
+        cell_->SetItems(uii.GetIdx());
+      }
+    }
+    return next;
+  }
+
+};
+
+// UniqueItemVector keeps its items in pages of kUniqueItemPageSize allocated as they fill up
+constexpr Ui32 kUniqueItemPageBits = 10;
+constexpr Ui32 kUniqueItemPageSize = Ui32(1) << kUniqueItemPageBits;
+constexpr Ui32 kUniqueItemPageMask = kUniqueItemPageSize - 1;
+
+// Items addressed by generational Uii. The storage grows a page at a time up to
+// the capacity and pages are never moved or freed, so the pointers items keep
+// to each other (and any other pointer to an item) stay valid as it grows.
+template <class T>
+class UniqueItemVector {
+ protected:
+  static_assert(std::is_base_of<UniqueItemBase, T>::value, "T must derive from UniqueItemBase");
+  std::vector<std::unique_ptr<T[]>> pages_;
+  Ui64 capacity_ = kUiiIdxMask;
+  Ui64 size_ = 0;
+  UniqueItemBase *free_ = nullptr;
+  Ui64 next_uid_ = 1;
+  // Idx of every live item, densely, and the position of each item in it
+  // (kInvalidUii.GetIdx() for the free ones)
+  std::vector<Ui32> live_;
+  std::vector<Ui32> live_position_;
+
+  T& Item(Ui64 idx) {
+    return pages_[idx >> kUniqueItemPageBits][idx & kUniqueItemPageMask];
+  }
+ public:
+  // Idx of some of the live items, for range-for
+  class LiveIdxRange {
+    const Ui32 *begin_;
+    const Ui32 *end_;
+   public:
+    LiveIdxRange(const Ui32 *begin, const Ui32 *end)
+      : begin_(begin)
+      , end_(end) {
+    }
+    const Ui32* begin() const {
+      return begin_;
+    }
+    const Ui32* end() const {
+      return end_;
+    }
+    size_t Size() const {
+      return size_t(end_ - begin_);
+    }
+  };
+
+  // Limits the number of items, nothing is allocated until they are added.
+  // Without it the limit is what Uii can address.
+  void Prepare(Ui64 capacity) {
+    Check(size_ == 0, "UniqueItemVector must be prepared before adding items!");
+    Check(capacity <= kUiiIdxMask, "UniqueItemVector can't hold this many items.");
+    capacity_ = capacity;
+    pages_.reserve(size_t((capacity + kUniqueItemPageMask) >> kUniqueItemPageBits));
+  }
+
+  T& operator[](Ui64 idx) {
+    Check(idx < size_, "UniqueItemVector can't access item with idx out of bounds.");
+    return Item(idx);
+  }
+
+  T* TryGetItem(Uii uii) {
+    if (uii.GetIdx() < size_) {
+      T &item = Item(uii.GetIdx());
+      if (item.uii == uii) {
+        return &item;
+      }
+    }
+    return nullptr;
+  }
+
+  Ui64 Size() {
+    return size_;
+  }
+
+  Ui64 LiveSize() {
+    return live_.size();
+  }
+
+  // The idx of every live item and nothing else, however many were freed, split into
+  // chunks of chunk_size, the last one may be shorter. The chunks are disjoint, so a pass
+  // can be spread over threads a chunk at a time. FreeItem moves the last live item into
+  // the place of the freed one, so items must not be added or freed during the pass.
+  Ui64 LiveChunkCount(Ui64 chunk_size) {
+    return (live_.size() + chunk_size - 1) / chunk_size;
+  }
+  LiveIdxRange LiveChunk(Ui64 chunk_idx, Ui64 chunk_size) {
+    Ui64 begin = std::min(chunk_idx * chunk_size, Ui64(live_.size()));
+    Ui64 end = std::min(begin + chunk_size, Ui64(live_.size()));
+    return LiveIdxRange(live_.data() + begin, live_.data() + end);
+  }
+
+  void FreeItem(Uii uii) {
+    Check(uii.GetIdx() < size_, "UniqueItemVector can't free item with idx out of bounds.");
+    T &item = Item(uii.GetIdx());
+    Check(item.uii == uii, "UniqueItemVector can't free item, uii mismatch.");
+    Check(item.next_ == nullptr, "UniqueItemVector can't free item, item is still on map or double free attempted, next_ != 0.");
+    Check(item.prev_ == nullptr, "UniqueItemVector can't free item, item is still on map or double free attempted. prev_ != 0.");
+    item.next_ = free_;
+    if (free_) {
+      free_->prev_ = &item;
+    }
+    free_ = &item;
+    free_->uii.NextUid();
+
+    Ui32 position = live_position_[uii.GetIdx()];
+    live_[position] = live_.back();
+    live_position_[live_[position]] = position;
+    live_.pop_back();
+    live_position_[uii.GetIdx()] = kInvalidUii.GetIdx();
+  }
+
+  Uii AddItem() {
+    Uii uii = kInvalidUii;
+    if (free_) {
+      Check(free_->uii.GetIdx() < size_, "UniqueItemVector can't add item, idx corruption detected (oob).");
+      Check(&Item(free_->uii.GetIdx()) == free_, "UniqueItemVector can't add item, idx corruption detected (wrong).");
+      free_->uii.NextUid();
+      uii = free_->uii;
+      free_ = std::exchange(free_->next_, nullptr);
+      if (free_) {
+        free_->prev_ = nullptr;
+      }
+    } else if (size_ < capacity_) {
+      if ((size_ & kUniqueItemPageMask) == 0) {
+        pages_.emplace_back(new T[kUniqueItemPageSize]());
+        live_position_.resize(size_t(size_ + kUniqueItemPageSize), kInvalidUii.GetIdx());
+      }
+      T &item = Item(size_);
+      item.next_ = nullptr;
+      item.prev_ = nullptr;
+      item.uii.Set(Ui32(size_), 0);
+      uii = item.uii;
+      ++size_;
+    } else {
+      return uii;
+    }
+    live_position_[uii.GetIdx()] = Ui32(live_.size());
+    live_.push_back(uii.GetIdx());
+    return uii;
+  }
+};
+
+// Structure-of-arrays counterpart of UniqueItemVector: items are addressed by the same
+// generational Uii, with the same uids (0 for a new slot, the next one on FreeItem and
+// again on reuse), but every field is a column of its own, Column<I>()[idx] being field I
+// of the item in slot idx. A pass that reads a couple of fields of every item streams
+// through just those columns instead of whole items.
+// Slots are never moved, but the columns are reallocated as they grow,
+// so column pointers are only good until the next AddItem.
+template <class... Ts>
+class UniqueItemColumns {
+  // Set in uids_ for the free slots
+  static constexpr Ui32 kFreeSlot = Ui32(1) << 31;
+  std::tuple<std::vector<Ts>...> columns_;
+  std::vector<Ui32> uids_;
+  std::vector<Ui32> free_;
+  Ui64 capacity_ = kUiiIdxMask;
+
+  template <size_t... Is>
+  void ReserveColumns(Ui64 capacity, std::index_sequence<Is...>) {
+    const int expand[] = {0, (std::get<Is>(columns_).reserve(size_t(capacity)), 0)...};
+    (void)expand;
+  }
+  template <size_t... Is>
+  void AddSlot(std::index_sequence<Is...>) {
+    const int expand[] = {0, (std::get<Is>(columns_).emplace_back(), 0)...};
+    (void)expand;
+  }
+  template <size_t... Is>
+  void ResetItem(Ui32 idx, std::index_sequence<Is...>) {
+    const int expand[] = {0, (std::get<Is>(columns_)[idx] = Ts(), 0)...};
+    (void)expand;
+  }
+ public:
+  template <size_t I>
+  using ColumnType = typename std::tuple_element<I, std::tuple<Ts...>>::type;
+
+  // A live item, or none if TryGetItem did not find it
+  class ItemRef {
+    UniqueItemColumns *columns_;
+    Ui32 idx_;
+   public:
+    ItemRef(UniqueItemColumns *columns, Ui32 idx)
+      : columns_(columns)
+      , idx_(idx) {
+    }
+    explicit operator bool() const {
+      return columns_ != nullptr;
+    }
+    Ui32 GetIdx() const {
+      return idx_;
+    }
+    template <size_t I>
+    ColumnType<I>& Get() const {
+      return columns_->template Column<I>()[idx_];
+    }
+  };
+
+  // Limits the number of items and allocates the columns for that many up front.
+  // Without it the limit is what Uii can address.
+  void Prepare(Ui64 capacity) {
+    Check(uids_.empty(), "UniqueItemColumns must be prepared before adding items!");
+    Check(capacity <= kUiiIdxMask, "UniqueItemColumns can't hold this many items.");
+    capacity_ = capacity;
+    ReserveColumns(capacity, std::index_sequence_for<Ts...>());
+    uids_.reserve(size_t(capacity));
+  }
+
+  template <size_t I>
+  ColumnType<I>* Column() {
+    return std::get<I>(columns_).data();
+  }
+
+  // Slots ever used, live or free, the columns are valid from 0 to Size()
+  Ui64 Size() {
+    return uids_.size();
+  }
+
+  bool IsLive(Ui32 idx) {
+    return idx < uids_.size() && !(uids_[idx] & kFreeSlot);
+  }
+
+  Uii GetUii(Ui32 idx) {
+    Check(IsLive(idx), "UniqueItemColumns can't GetUii of a free slot.");
+    return Uii(idx, uids_[idx]);
+  }
+
+  ItemRef TryGetItem(Uii uii) {
+    Ui32 idx = uii.GetIdx();
+    if (idx < uids_.size() && uids_[idx] == uii.GetUid()) {
+      return ItemRef(this, idx);
+    }
+    return ItemRef(nullptr, 0);
+  }
+
+  void FreeItem(Uii uii) {
+    Check(uii.GetIdx() < uids_.size(), "UniqueItemColumns can't free item with idx out of bounds.");
+    Check(uids_[uii.GetIdx()] == uii.GetUid(), "UniqueItemColumns can't free item, uii mismatch or double free attempted.");
+    uids_[uii.GetIdx()] = ((uii.GetUid() + 1) & kUiiUidMask) | kFreeSlot;
+    free_.push_back(uii.GetIdx());
+  }
+
+  // Returns kInvalidUii if there is no room, the fields of the new item are value-initialized
+  Uii AddItem() {
+    Ui32 idx = 0;
+    if (free_.size()) {
+      idx = free_.back();
+      free_.pop_back();
+      uids_[idx] = ((uids_[idx] & ~kFreeSlot) + 1) & kUiiUidMask;
+      ResetItem(idx, std::index_sequence_for<Ts...>());
+    } else if (uids_.size() < capacity_) {
+      idx = Ui32(uids_.size());
+      uids_.push_back(0);
+      AddSlot(std::index_sequence_for<Ts...>());
+    } else {
+      return kInvalidUii;
+    }
+    return Uii(idx, uids_[idx]);
+  }
+};
+
+constexpr Ui32 kUiiQueueInitialCapacity = 16;
+
+// FIFO of Uii that holds at most one entry per item idx, PushBack of an item
+// that is already queued only refreshes its uid in place.
+// Memory is proportional to the peak number of queued items: a ring of Uii
+// that doubles when full and an open-addressing (linear probing) map from
+// item idx to the sequence number of its entry in the ring.
+class UiiQueue {
+  struct Position {
+    Ui32 idx = kUiiIdxMask;
+    Ui32 seq = 0;
+  };
+  std::vector<Uii> queue_;
+  std::vector<Position> queue_position_;
+  Ui32 front_seq_ = 0;
+  Ui32 length_ = 0;
+  Ui32 position_bits_ = 0;
+
+  Ui32 HomeSlot(Ui32 idx) const {
+    return (idx * 0x9E3779B1u) >> (32 - position_bits_);
+  }
+
+  // Returns the slot holding idx or the empty slot where idx should be inserted
+  Ui32 FindSlot(Ui32 idx) const {
+    Ui32 mask = Ui32(queue_position_.size() - 1);
+    Ui32 slot = HomeSlot(idx);
+    while (queue_position_[slot].idx != idx && queue_position_[slot].idx != kUiiIdxMask) {
+      slot = (slot + 1) & mask;
+    }
+    return slot;
+  }
+
+  void EraseSlot(Ui32 hole) {
+    Ui32 mask = Ui32(queue_position_.size() - 1);
+    Ui32 slot = (hole + 1) & mask;
+    while (queue_position_[slot].idx != kUiiIdxMask) {
+      Ui32 home = HomeSlot(queue_position_[slot].idx);
+      if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+        queue_position_[hole] = queue_position_[slot];
+        hole = slot;
+      }
+      slot = (slot + 1) & mask;
+    }
+    queue_position_[hole] = Position();
+  }
+
+  void Grow() {
+    size_t capacity = queue_.size() ? queue_.size() * 2 : kUiiQueueInitialCapacity;
+    Check(capacity <= kUiiIdxMask, "UiiQueue cant grow, capacity reached!");
+    std::vector<Uii> queue(capacity);
+    for (Ui32 i = 0; i < length_; ++i) {
+      Ui32 seq = front_seq_ + i;
+      queue[seq & (capacity - 1)] = queue_[seq & (queue_.size() - 1)];
+    }
+    queue_.swap(queue);
+
+    // Keep the map at most half full
+    position_bits_ = 1;
+    while ((size_t(1) << position_bits_) < capacity * 2) {
+      ++position_bits_;
+    }
+    queue_position_.assign(size_t(1) << position_bits_, Position());
+    for (Ui32 i = 0; i < length_; ++i) {
+      Ui32 seq = front_seq_ + i;
+      Ui32 idx = queue_[seq & (capacity - 1)].GetIdx();
+      Position &p = queue_position_[FindSlot(idx)];
+      p.idx = idx;
+      p.seq = seq;
+    }
+  }
+
+ public:
+  void PushBack(Uii uii) {
+    Check(uii.GetIdx() != kUiiIdxMask, "UiiQueue cant PushBack an invalid item!");
+    if (queue_.size()) {
+      Position &p = queue_position_[FindSlot(uii.GetIdx())];
+      if (p.idx == uii.GetIdx()) {
+        Uii &queued = queue_[p.seq & (queue_.size() - 1)];
+        if (queued.GetUid() != uii.GetUid()) {
+          queued = uii;
+        }
+        return;
+      }
+    }
+    if (length_ == queue_.size()) {
+      Grow();
+    }
+    Ui32 seq = front_seq_ + length_;
+    Position &p = queue_position_[FindSlot(uii.GetIdx())];
+    p.idx = uii.GetIdx();
+    p.seq = seq;
+    queue_[seq & (queue_.size() - 1)] = uii;
+    ++length_;
+  }
+
+  size_t Length() {
+    return length_;
+  }
+
+  Uii PreviewFront() {
+    Check(length_, "UiiQueue cant PreviewFront, it is empty!");
+    return queue_[front_seq_ & (queue_.size() - 1)];
+  }
+
+  Uii PopFront() {
+    Check(length_, "UiiQueue cant PopFront, it is empty!");
+    Uii uii = queue_[front_seq_ & (queue_.size() - 1)];
+    ++front_seq_;
+    --length_;
+    EraseSlot(FindSlot(uii.GetIdx()));
+    return uii;
+  }
+};
+
+// Per-connection replication scheduler. Every queued item builds up priority
+// each time the connection has room to send, at a rate given by the caller
+// (distance, state...), and the packet is filled highest priority first.
+// Items that are not sent keep their priority, so nothing starves.
+class ReplicationScheduler {
+  struct Entry {
+    Ui32 idx;
+    float priority;
+  };
+  static bool IsLowerPriority(const Entry &a, const Entry &b) {
+    return a.priority < b.priority;
+  }
+  // Max-heap on priority between Accumulate calls
+  std::vector<Entry> heap_;
+  // Queued item by idx, only written on PushBack of a new item and on PopHighest
+  std::unordered_map<Ui32, Uii> queued_uii_;
+ public:
+  // Queues the item, an item that is already queued keeps its priority
+  void PushBack(Uii uii) {
+    auto inserted = queued_uii_.emplace(uii.GetIdx(), uii);
+    if (!inserted.second) {
+      inserted.first->second = uii;
+      return;
+    }
+    Entry e;
+    e.idx = uii.GetIdx();
+    e.priority = 0.f;
+    heap_.push_back(e);
+    std::push_heap(heap_.begin(), heap_.end(), IsLowerPriority);
+  }
+
+  size_t Length() {
+    return heap_.size();
+  }
+
+  // Adds rate(uii) * dt to every queued item and reorders them for PopHighest.
+  // Rebuilding the heap is linear, and a fill usually pops only a few of the items.
+  template <class RateFunc>
+  void Accumulate(double dt, RateFunc rate) {
+    for (Entry &e : heap_) {
+      e.priority += float(rate(queued_uii_.find(e.idx)->second) * dt);
+    }
+    std::make_heap(heap_.begin(), heap_.end(), IsLowerPriority);
+  }
+
+  Uii PopHighest() {
+    Check(heap_.size(), "ReplicationScheduler cant PopHighest, it is empty!");
+    std::pop_heap(heap_.begin(), heap_.end(), IsLowerPriority);
+    auto it = queued_uii_.find(heap_.back().idx);
+    heap_.pop_back();
+    Uii uii = it->second;
+    queued_uii_.erase(it);
+    return uii;
+  }
+};
+
+class Map {
+  Ui32 width_;
+  Ui32 height_;
+  std::vector<MapCell> cells_;
+ public:
+
+  Map(Ui32 width, Ui32 height)
+    : width_(width)
+    , height_(height)
+    , cells_(width_*height_) {
+  }
+
+  Ui32 Width() const {
+    return width_;
+  }
+
+  Ui32 Height() const {
+    return height_;
+  }
+
+  MapCell& At(Ui32 x, Ui32 y) {
+    return cells_[y*width_ + x];
+  }
+
+  const MapCell& At(Ui32 x, Ui32 y) const {
+    return cells_[y*width_ + x];
+  }
+
+  Vec2Si32 GetCellPos(const MapCell *cell) const {
+    Ui32 idx = Ui32(cell - cells_.data());
+    Check(idx < cells_.size(), "Map can't GetCellPos of a cell that is not on this map.");
+    return Vec2Si32(Si32(idx % width_), Si32(idx / width_));
+  }
+};
+
+enum ChState {
+  kChStateIdle = 0,
+  kChStateWalkToPoint,
+  kChStateWalkToItem,
+  kChStateWalkToAttack,
+  kChStatePlayAttack,
+  kChStatePlayDying,
+  kChStateDead,
+  kChStateCount
+};
+
+// Avatars walk in a straight line at a constant speed and stop at the destination,
+// as Character::Walk does. The server simulation and the client prediction both use
+// these, so a walk predicted by the client ends up where the server puts it.
+// Speed in map cells per second.
+constexpr double kAvatarWalkSpeed = 4.0;
+
+// Ticks a walk from begin to end takes
+inline Ui32 GetWalkDurationTicks(Vec2Si32 begin, Vec2Si32 end, double tick_duration) {
+  double dx = double(end.x - begin.x);
+  double dy = double(end.y - begin.y);
+  return Ui32(std::ceil(std::sqrt(dx * dx + dy * dy) / (kAvatarWalkSpeed * tick_duration)));
+}
+
+// The cell a walk from begin at begin_tick to end at end_tick is at on tick
+inline Vec2Si32 GetWalkCellAt(Vec2Si32 begin, Vec2Si32 end, Ui32 begin_tick, Ui32 end_tick,
+    Ui32 tick) {
+  if (Si32(tick - begin_tick) <= 0) {
+    return begin;
+  }
+  if (Si32(tick - end_tick) >= 0) {
+    return end;
+  }
+  double f = double(tick - begin_tick) / double(end_tick - begin_tick);
+  return Vec2Si32(begin.x + Si32(std::lround(double(end.x - begin.x) * f)),
+    begin.y + Si32(std::lround(double(end.y - begin.y) * f)));
+}
+
+// Replicated fields of an Avatar that changed since it was last queued for replication
+enum AvatarDirtyFlags {
+  kAvatarDirtyState = 1 << 0,
+  kAvatarDirtyPosition = 1 << 1,
+  kAvatarDirtyTarget = 1 << 2,
+  kAvatarDirtyAll = kAvatarDirtyState | kAvatarDirtyPosition | kAvatarDirtyTarget
+};
+
+// The fields of Avatar the per-tick motion pass reads, laid out as UniqueItemColumns
+// in step with the avatars: columns.Column<kAvatarColumnEndTick>()[avatar.uii.GetIdx()]
+enum AvatarColumn {
+  kAvatarColumnState = 0,
+  kAvatarColumnBeginPos,
+  kAvatarColumnEndPos,
+  kAvatarColumnBeginTick,
+  kAvatarColumnEndTick,
+  // The map cell the avatar is in, kAvatarOffMap if it is not on the map
+  kAvatarColumnCellPos
+};
+typedef UniqueItemColumns<Ui8, Vec2Si32, Vec2Si32, Ui32, Ui32, Vec2Si32> AvatarColumns;
+const Vec2Si32 kAvatarOffMap(-1, -1);
+
+class Avatar : public UniqueItemBase {
+  // Where the setters copy the state and the walk to, if anywhere, see AttachMotion
+  AvatarColumns *motion_ = nullptr;
+
+  void StoreMotion() {
+    if (!motion_) {
+      return;
+    }
+    auto motion = motion_->TryGetItem(uii);
+    if (motion) {
+      motion.Get<kAvatarColumnState>() = Ui8(state);
+      motion.Get<kAvatarColumnBeginPos>() = begin_pos;
+      motion.Get<kAvatarColumnEndPos>() = end_pos;
+      motion.Get<kAvatarColumnBeginTick>() = begin_tick;
+      motion.Get<kAvatarColumnEndTick>() = end_tick;
+    }
+  }
+ public:
+  // ConnectionPool handle of the connection controlling the avatar
+  Uii connection_handle = kInvalidUii;
+  Ui8 unit_type = 0;
+  // Only changed through SetState and SetMove, which keep the AvatarColumns copy up to date
+  ChState state = kChStateIdle;
+  Vec2Si32 begin_pos = Vec2Si32(0, 0);
+  Vec2Si32 end_pos = Vec2Si32(0, 0);
+  Ui32 begin_tick = 0;
+  Ui32 end_tick = 0;
+  Uii target_uii = kInvalidUii;
+  // Set by NetServerState::OnAvatarChanged, cleared once the change is queued
+  Ui8 dirty_flags = 0;
+
+  // From now on the setters copy the state and the walk to the item of the same Uii
+  // in motion, starting with the current ones
+  void AttachMotion(AvatarColumns *motion) {
+    motion_ = motion;
+    StoreMotion();
+  }
+
+  // The setters return the AvatarDirtyFlags of what actually changed, for OnAvatarChanged
+  Ui8 SetState(ChState in_state) {
+    if (state == in_state) {
+      return 0;
+    }
+    state = in_state;
+    StoreMotion();
+    return kAvatarDirtyState;
+  }
+  Ui8 SetMove(Vec2Si32 in_begin_pos, Vec2Si32 in_end_pos, Ui32 in_begin_tick, Ui32 in_end_tick) {
+    if (begin_pos == in_begin_pos && end_pos == in_end_pos &&
+        begin_tick == in_begin_tick && end_tick == in_end_tick) {
+      return 0;
+    }
+    begin_pos = in_begin_pos;
+    end_pos = in_end_pos;
+    begin_tick = in_begin_tick;
+    end_tick = in_end_tick;
+    StoreMotion();
+    return kAvatarDirtyPosition;
+  }
+  Vec2Si32 GetCellAt(Ui32 in_tick) const {
+    return GetWalkCellAt(begin_pos, end_pos, begin_tick, end_tick, in_tick);
+  }
+  Ui8 SetTarget(Uii in_target_uii) {
+    if (target_uii == in_target_uii) {
+      return 0;
+    }
+    target_uii = in_target_uii;
+    return kAvatarDirtyTarget;
+  }
+};
+
+}  // namespace arctic
+
+#endif /* world_hpp */